@@ -0,0 +1,59 @@
+/*
+ * Example mini-ipc client, with many coroutine calls in flight
+ *
+ * Released in the public domain
+ *
+ * All calls share the same channel and the same thread: the
+ * total time is about the longest delay, not the sum of them all.
+ */
+#include <cstdio>
+#include <cstdlib>
+
+#include "minipc-coro.hpp"
+#include "coro-structs.h"
+
+#define CORO_TIMEOUT 2000 /* ms */
+
+static minipc::poll_executor ex;
+static int ndone, nerr;
+
+static minipc::detached one_call(minipc::client &c, int i)
+{
+	int ms = i % 100;
+
+	try {
+		int sum = co_await c.call<int>(&coro_delay_add, CORO_TIMEOUT,
+					       ms, i, 1000);
+		if (sum != i + 1000)
+			nerr++;
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "call %i: %s\n", i, e.what());
+		nerr++;
+	}
+	ndone++;
+}
+
+int main(int argc, char **argv)
+{
+	int i, n = 1000;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+	try {
+		minipc::client client(ex, CORO_RPC_NAME);
+		auto t0 = minipc::clock::now();
+
+		for (i = 0; i < n; i++)
+			one_call(client, i);
+		while (ndone < n)
+			ex.run_once();
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>
+			(minipc::clock::now() - t0).count();
+		printf("%i calls, %i errors, %lli ms\n", n, nerr,
+		       (long long)us / 1000);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		exit(1);
+	}
+	return nerr != 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Example mini-ipc server, whose function is a coroutine
+ *
+ * Released in the public domain
+ *
+ * Every call waits for a while before replying, but it doesn't
+ * stall the other clients: the reply is sent by the coroutine later.
+ */
+#include <cstdio>
+#include <cstdlib>
+
+#include "minipc-coro.hpp"
+#include "coro-structs.h"
+
+static minipc::poll_executor ex;
+
+static minipc::detached delay_add(minipc::reply r, uint32_t *args)
+{
+	/* args live in the request packet: copy them before co_await */
+	int ms = args[0], a = args[1], b = args[2];
+
+	co_await minipc::after(ex, ms);
+	r.send(a + b);
+}
+
+int main(int argc, char **argv)
+{
+	try {
+		minipc::server server(ex, CORO_RPC_NAME);
+
+		server.export_function(&coro_delay_add, delay_add);
+		ex.run();
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Example mini-ipc coroutines: the procedure shared by server and client
+ *
+ * Released in the public domain
+ */
+#ifndef __CORO_STRUCTS_H__
+#define __CORO_STRUCTS_H__
+
+#include "minipc.h"
+
+#define CORO_RPC_NAME "coro-server"
+
+/* Return a + b, after a delay in milliseconds */
+static struct minipc_pd coro_delay_add = {
+	.f = nullptr,
+	.name = "delay-add",
+	.flags = MINIPC_PD_FLAG_COALESCE, /* same args, same sum */
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+	.args = {
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_END,
+	},
+};
+
+#endif /* __CORO_STRUCTS_H__ */
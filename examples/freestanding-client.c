@@ -0,0 +1,106 @@
+/*
+ * Mini-ipc: benchmark of a freestanding server, through its memory
+ *
+ * Released in the public domain
+ *
+ * Calls "sum" in a loop, and reports latency and throughput. The host
+ * side polls the memory every <poll-us>, which weighs on latency as
+ * much as the server does; with <max-us> too, polling backs off up to
+ * that while idle. Without the hardware, run freestanding-sim
+ * ("make sim") and pass the same MINIPC_MEM_FILE to both programs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "minipc.h"
+
+#define FS_TIMEOUT 1000
+
+const struct minipc_pd ss_sum_struct = {
+	.name = "sum",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+	.args = {
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_END,
+	},
+};
+
+static uint64_t fs_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int fs_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	struct minipc_ch *client;
+	const char *name = "mem:f000";
+	int i, n = 1000, poll_us = 0, max_us = 0, sum, errors = 0;
+	struct minipc_poll_stats ps;
+	uint64_t t0, t;
+	uint32_t *lat;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+	if (argc > 2)
+		name = argv[2];
+	if (argc > 3)
+		poll_us = atoi(argv[3]);
+	if (argc > 4)
+		max_us = atoi(argv[4]);
+	if (n <= 0 || poll_us < 0 || (max_us && max_us < poll_us)) {
+		fprintf(stderr, "%s: Use \"%s [<calls> [<name> [<poll-us> "
+			"[<max-us>]]]]\"\n", argv[0], argv[0]);
+		exit(1);
+	}
+	if (poll_us)
+		minipc_set_poll(poll_us);
+	lat = calloc(n, sizeof(*lat));
+	client = minipc_client_create(name, 0);
+	if (!lat || !client) {
+		fprintf(stderr, "%s: client_create(%s): %s\n", argv[0], name,
+			strerror(errno));
+		exit(1);
+	}
+	if (max_us)
+		minipc_set_poll_range(client, poll_us ? poll_us : 1, max_us);
+
+	t0 = fs_now();
+	for (i = 0; i < n; i++) {
+		t = fs_now();
+		if (minipc_call(client, FS_TIMEOUT, &ss_sum_struct, &sum,
+				i, 1) < 0 || sum != i + 1)
+			errors++;
+		lat[i] = (fs_now() - t) / 1000;
+	}
+	t = fs_now() - t0;
+
+	qsort(lat, n, sizeof(*lat), fs_cmp);
+	printf("%i calls, %i errors, %.0f calls/s\n", n, errors,
+	       n * 1e9 / t);
+	printf("latency (us): min %u, p50 %u, p99 %u, max %u\n", lat[0],
+	       lat[n / 2], lat[(int)((n - 1) * .99)], lat[n - 1]);
+	if (max_us && minipc_get_poll_stats(client, &ps) == 0) {
+		printf("polls %u, events %u, ms per level:", ps.polls,
+		       ps.events);
+		for (i = 0; i < MINIPC_POLL_LEVELS && (poll_us << i) < 2 * max_us;
+		     i++)
+			printf(" %llu", (unsigned long long)ps.level_us[i] / 1000);
+		printf("\n");
+	}
+	minipc_close(client);
+	return errors != 0;
+}
@@ -5,11 +5,18 @@
  * Author: Alessandro Rubini <rubini@gnudd.com>
  *
  * This code is copied from trivial-server, and made even more trivial
+ *
+ * "make sim" builds it hosted as freestanding-sim, on a file that stands
+ * for the memory: "freestanding-sim [<latency-ns> [<period-us>]]"
  */
 
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#ifdef MINIPC_MEM_SIM
+#include <stdio.h>
+#include <stdlib.h>
+#endif
 #include "minipc.h"
 
 /* A function that ignores the RPC and is written normally */
@@ -66,16 +73,32 @@ const struct minipc_pd ss_mul_struct = {
 
 int main(int argc, char **argv)
 {
-	struct minipc_ch *server;
+	struct minipc_ch *server, *diag;
+
+#ifdef MINIPC_MEM_SIM
+	const char *fname = getenv("MINIPC_MEM_FILE");
 
-	server = minipc_server_create("mem:f000", 0);
-	if (!server)
+	if (!fname)
+		fname = MINIPC_MEM_SIM_FILE;
+	if (minipc_mem_sim(fname, MINIPC_MEM_SIM_SIZE,
+			   argc > 1 ? atoi(argv[1]) : 0,
+			   argc > 2 ? atoi(argv[2]) : 0) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], fname,
+			strerror(errno));
+		return 1;
+	}
+#endif
+	/* A real-time channel, and a low-priority one for diagnostics */
+	server = minipc_server_create("mem:f000", MINIPC_FLAG_PRIO(0));
+	diag = minipc_server_create("mem:20000", MINIPC_FLAG_PRIO(1));
+	if (!server || !diag)
 		return 1;
 	minipc_export(server, &ss_sum_struct);
 	minipc_export(server, &ss_mul_struct);
+	minipc_export(diag, &ss_mul_struct);
 	while (1) {
 		/* do something else... */
-		minipc_server_action(server, 1000);
+		minipc_server_action_all(1000);
 	}
 }
 
@@ -22,14 +22,33 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/shm.h>
-#include <sys/select.h>
 
 #include "minipc.h"
 #include "minipc-shmem.h" /* The shared data structures */
 
 struct minipc_mbox_info *info; /* unfortunately global... */
 
+/* The fds of the mini-ipc server, as the library tells us */
+static struct pollfd pfd[MINIPC_MAX_CLIENTS + 1];
+static int npfd;
+
+static void mb_fd_hook(struct minipc_ch *ch, int fd, int add, void *arg)
+{
+	int i;
+
+	if (add) {
+		pfd[npfd].fd = fd;
+		pfd[npfd].events = POLLIN;
+		npfd++;
+		return;
+	}
+	for (i = 0; i < npfd; i++)
+		if (pfd[i].fd == fd)
+			pfd[i] = pfd[--npfd];
+}
+
 /* This function implements the "stat" mini-ipc server, by asking mbox  */
 static int mb_stat_server(const struct minipc_pd *pd,
 			  uint32_t *args, void *ret)
@@ -108,6 +127,7 @@ int main(int argc, char **argv)
 	}
 	minipc_set_logfile(server, stderr);
 	minipc_export(server, &mb_stat_struct);
+	minipc_server_set_fd_hook(server, mb_fd_hook, NULL);
 
 	/* Connect as a client to the trivial-server */
 	client = minipc_client_create("trivial", 0);
@@ -119,20 +139,18 @@ int main(int argc, char **argv)
 
 	/* Loop serving both mini-ipc and the mailbox */
 	while (1) {
-		fd_set set;
-		struct timeval to = {
-			MBOX_POLL_US / (1000*1000),
-			MBOX_POLL_US % (1000*1000)
-		};
-
-		minipc_server_get_fdset(server, &set);
+		int i, nready, ready[MINIPC_MAX_CLIENTS + 1];
 
 		/* Wait for any server, with the defined timeout */
-		ret = select(16 /* hack */, &set, NULL, NULL, &to);
-
-		if (ret > 0) {
-			if (minipc_server_action(server, 0) < 0) {
-				fprintf(stderr, "%s: server_action(): %s\n",
+		ret = poll(pfd, npfd, MBOX_POLL_US / 1000);
+
+		/* Handling an fd may change the array: collect them first */
+		for (i = nready = 0; ret > 0 && i < npfd; i++)
+			if (pfd[i].revents)
+				ready[nready++] = pfd[i].fd;
+		for (i = 0; i < nready; i++) {
+			if (minipc_server_handle_fd(server, ready[i]) < 0) {
+				fprintf(stderr, "%s: server_handle_fd(): %s\n",
 					argv[0], strerror(errno));
 				exit(1);
 			}
@@ -0,0 +1,84 @@
+/*
+ * Example mini-ipc client passing file descriptors
+ *
+ * Copyright (C) 2011 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released in the public domain
+ */
+#define _GNU_SOURCE /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "minipc.h"
+#include "memfd-structs.h"
+
+#define CLIENT_TIMEOUT 1000 /* ms */
+
+int main(int argc, char **argv)
+{
+	struct minipc_ch *client;
+	int i, fd, size, ret;
+	unsigned char *buf;
+	uint64_t sum, lsum;
+
+	size = 16 << 20; /* 16MB: way more than a packet may host */
+	if (argc > 1)
+		size = atoi(argv[1]);
+
+	client = minipc_client_create(MEMFD_RPC_NAME, 0);
+	if (!client) {
+		fprintf(stderr, "%s: client_create(): %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+
+	/* Prepare a buffer in a memfd and ask the server to sum it */
+	fd = memfd_create("minipc-sum", 0);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		fprintf(stderr, "%s: memfd: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+	for (i = 0, lsum = 0; i < size; i++)
+		lsum += (buf[i] = i);
+	ret = minipc_call(client, CLIENT_TIMEOUT, &rpc_memsum, &sum,
+			  fd, size);
+	if (ret < 0)
+		goto error;
+	printf("memsum(%i bytes) = %lli (local %lli)\n", size,
+	       (long long)sum, (long long)lsum);
+	munmap(buf, size);
+	close(fd);
+
+	/* Then ask a filled buffer back, and check it */
+	ret = minipc_call(client, CLIENT_TIMEOUT, &rpc_memfill, &fd,
+			  size, 0x5a);
+	if (ret < 0)
+		goto error;
+	buf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < size; i++)
+		if (buf[i] != 0x5a)
+			break;
+	printf("memfill(%i bytes): %s\n", size,
+	       i == size ? "ok" : "mismatch");
+	munmap(buf, size);
+	close(fd);
+	return 0;
+
+ error:
+	fprintf(stderr, "Error in rpc: %s\n", strerror(errno));
+	exit(1);
+}
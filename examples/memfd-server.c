@@ -0,0 +1,92 @@
+/*
+ * Example mini-ipc server passing file descriptors
+ *
+ * Copyright (C) 2011 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released in the public domain
+ */
+#define _GNU_SOURCE /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "minipc.h"
+#include "memfd-structs.h"
+
+/* Sum all bytes of a buffer the client placed in a memfd */
+static int mf_sum_function(const struct minipc_pd *pd,
+			   uint32_t *args, void *ret)
+{
+	int fd, size, i;
+	unsigned char *buf;
+	uint64_t sum = 0;
+
+	fd = args[0];
+	args = minipc_get_next_arg(args, pd->args[0]);
+	size = args[0];
+
+	buf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED)
+		return -1;
+	for (i = 0; i < size; i++)
+		sum += buf[i];
+	munmap(buf, size);
+	*(uint64_t *)ret = sum;
+	return 0; /* the library closes fd for us */
+}
+
+/* Create a memfd, fill it and pass it back to the client */
+static int mf_fill_function(const struct minipc_pd *pd,
+			    uint32_t *args, void *ret)
+{
+	int fd, size, val;
+	void *buf;
+
+	size = args[0];
+	args = minipc_get_next_arg(args, pd->args[0]);
+	val = args[0];
+
+	fd = memfd_create("minipc-fill", 0);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0)
+		goto err;
+	buf = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED)
+		goto err;
+	memset(buf, val, size);
+	munmap(buf, size);
+	*(int *)ret = fd; /* the library passes it and closes it */
+	return 0;
+ err:
+	close(fd);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct minipc_ch *server;
+
+	server = minipc_server_create(MEMFD_RPC_NAME, 0);
+	if (!server) {
+		fprintf(stderr, "%s: server_create(): %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+	minipc_set_logfile(server, stderr);
+	rpc_memsum.f = mf_sum_function;
+	rpc_memfill.f = mf_fill_function;
+	minipc_export(server, &rpc_memsum);
+	minipc_export(server, &rpc_memfill);
+	while (1) {
+		if (minipc_server_action(server, 1000) < 0) {
+			fprintf(stderr, "%s: server_action(): %s\n", argv[0],
+				strerror(errno));
+			exit(1);
+		}
+	}
+}
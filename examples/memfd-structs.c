@@ -0,0 +1,38 @@
+/*
+ * Structures for the memfd mini-ipc example
+ *
+ * Copyright (C) 2011 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released in the public domain
+ */
+
+/*
+ * This file defines the data structures used to describe the RPC calls
+ * between server and client. Note that the function pointers are only
+ * instantiated in the server
+ */
+#include "minipc.h"
+#include "memfd-structs.h"
+
+/* sum the bytes of a buffer: the data is passed as a file descriptor */
+struct minipc_pd rpc_memsum = {
+	.name = "memsum",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT64, uint64_t),
+	.args = {
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_FD, int),
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int), /* size */
+		MINIPC_ARG_END,
+	},
+};
+
+/* get back a file descriptor for a buffer filled by the server */
+struct minipc_pd rpc_memfill = {
+	.name = "memfill",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_FD, int),
+	.args = {
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int), /* size */
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int), /* value */
+		MINIPC_ARG_END,
+	},
+};
@@ -0,0 +1,6 @@
+#include "minipc.h"
+
+#define MEMFD_RPC_NAME "memfd-server"
+
+/* structures are in memfd-structs.c */
+extern struct minipc_pd rpc_memsum, rpc_memfill;
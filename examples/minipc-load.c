@@ -0,0 +1,493 @@
+/*
+ * Open-loop load generator for mini-ipc socket servers
+ *
+ * Released in the public domain
+ *
+ * Requests leave at the scheduled times, whether or not the earlier
+ * ones got a reply: a closed loop slows down with the server, and
+ * hides its queueing delay. For the same reason, latency is measured
+ * from the scheduled time, not from the time the request was sent.
+ */
+#define _GNU_SOURCE /* ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "minipc.h"
+
+#define LOAD_MAX_SIG	16
+#define LOAD_MAX_ARGS	8
+#define LOAD_MAX_CONN	64	/* per thread */
+#define LOAD_PENDING	4096	/* requests in flight, per connection */
+#define LOAD_NBUCKETS	(29 * 16) /* 16 per power of two, up to 2^32 us */
+
+/* A procedure, with the values we pass to it */
+union load_val {
+	int i;
+	uint64_t l;
+	double d;
+};
+
+struct load_sig {
+	struct minipc_pd *pd;
+	union load_val val[LOAD_MAX_ARGS];
+	void *argv[LOAD_MAX_ARGS];
+};
+
+struct load_req {
+	uint64_t t;		/* scheduled time (ns), 0 if the entry is free */
+	uint32_t seq;
+	int sig;
+};
+
+struct load_stats {
+	uint64_t sent, dropped, ok, errors, remote, timeouts;
+	uint64_t min, max;
+	uint64_t hist[LOAD_NBUCKETS];
+};
+
+struct load_thread {
+	pthread_t tid;
+	int index;
+	struct load_stats st;
+};
+
+/* Configuration, set by main() before the threads start */
+static char *load_name = "trivial";
+static int load_rate = 1000, load_secs = 5, load_nthreads = 1;
+static int load_nconn = 1, load_strsize = 16, load_timeout = 1000;
+static struct load_sig load_sigs[LOAD_MAX_SIG];
+static int load_nsig;
+static char *load_string;
+static char load_zero[MINIPC_MAX_ARGUMENTS * 4];
+static uint64_t load_t0;
+
+static uint64_t load_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Log-linear histogram: 16 buckets for each power of two */
+static int load_bucket(uint64_t us)
+{
+	int e;
+
+	if (us < 16)
+		return us;
+	e = 63 - __builtin_clzll(us);
+	if (e > 31)
+		return LOAD_NBUCKETS - 1;
+	return (e - 3) * 16 + ((us >> (e - 4)) & 15);
+}
+
+static uint64_t load_bucket_us(int b)
+{
+	if (b < 16)
+		return b;
+	return (16ULL + b % 16) << (b / 16 - 1);
+}
+
+/* Types are i (int), l (int64), d (double), s (string), S<n> (struct) */
+static int load_type(char **s, uint32_t *type)
+{
+	char *e;
+	long n;
+
+	switch (*(*s)++) {
+	case 'i':
+		*type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int);
+		return 0;
+	case 'l':
+		*type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT64, uint64_t);
+		return 0;
+	case 'd':
+		*type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_DOUBLE, double);
+		return 0;
+	case 's':
+		*type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRING, char *);
+		return 0;
+	case 'S':
+		n = strtol(*s, &e, 0);
+		if (e == *s || n <= 0 || n > MINIPC_MAX_REPLY)
+			return -1;
+		*s = e;
+		*type = __MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRUCT, n);
+		return 0;
+	}
+	return -1;
+}
+
+/* A signature is "name:retval:args", like "sum:i:ii" */
+static int load_add_sig(char *spec)
+{
+	struct load_sig *sig = load_sigs + load_nsig;
+	struct minipc_pd *pd;
+	char *ret, *args;
+	int i;
+
+	ret = strchr(spec, ':');
+	if (!ret || ret - spec >= MINIPC_MAX_NAME
+	    || load_nsig == LOAD_MAX_SIG)
+		return -1;
+	*ret++ = '\0';
+	args = strchr(ret, ':');
+	if (args)
+		*args++ = '\0';
+	else
+		args = "";
+
+	pd = calloc(1, sizeof(*pd) + (LOAD_MAX_ARGS + 1) * sizeof(uint32_t));
+	if (!pd)
+		return -1;
+	strcpy(pd->name, spec);
+	if (load_type(&ret, &pd->retval) < 0 || *ret)
+		goto err;
+	for (i = 0; *args; i++) {
+		if (i == LOAD_MAX_ARGS || load_type(&args, pd->args + i) < 0)
+			goto err;
+		sig->val[i].i = i + 1;
+		switch (MINIPC_GET_ATYPE(pd->args[i])) {
+		case MINIPC_ATYPE_INT64:
+			sig->val[i].l = i + 1;
+			break;
+		case MINIPC_ATYPE_DOUBLE:
+			sig->val[i].d = i + 1.0;
+			break;
+		}
+		sig->argv[i] = sig->val + i;
+		if (MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_STRING)
+			sig->argv[i] = load_string;
+		if (MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_STRUCT)
+			sig->argv[i] = load_zero;
+	}
+	pd->args[i] = MINIPC_ARG_END;
+	sig->pd = pd;
+	load_nsig++;
+	return 0;
+ err:
+	free(pd);
+	return -1;
+}
+
+static int load_read_sigs(const char *fname)
+{
+	char line[256], *s;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, " \t\r\n#")] = '\0';
+		if (!line[0])
+			continue;
+		s = strdup(line);
+		if (!s || load_add_sig(s) < 0) {
+			fprintf(stderr, "%s: invalid signature \"%s\"\n",
+				fname, line);
+			exit(1);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Collect the replies of one connection */
+static int load_recv(struct load_thread *t, struct minipc_ch *ch,
+		     struct load_req *pend)
+{
+	static __thread uint8_t ret[MINIPC_MAX_REPLY];
+	struct load_stats *st = &t->st;
+	struct load_req *r;
+	uint64_t lat;
+	uint32_t seq;
+	int n = 0;
+
+	while (minipc_call_recv(ch, &seq) == 0) {
+		if (!seq) {
+			st->errors++; /* refused: too many clients */
+			continue;
+		}
+		r = pend + seq % LOAD_PENDING;
+		if (!r->t || r->seq != seq)
+			continue; /* counted as timeout already */
+		lat = load_now() - r->t;
+		r->t = 0;
+		n++;
+		if (minipc_call_decode(ch, load_sigs[r->sig].pd, ret) < 0) {
+			if (errno == EREMOTEIO)
+				st->remote++;
+			else
+				st->errors++;
+			continue;
+		}
+		if (lat > load_timeout * 1000000ULL) {
+			st->timeouts++;
+			continue;
+		}
+		lat /= 1000;
+		st->ok++;
+		st->hist[load_bucket(lat)]++;
+		if (lat > st->max)
+			st->max = lat;
+		if (lat < st->min)
+			st->min = lat;
+	}
+	if (errno != EAGAIN) {
+		fprintf(stderr, "minipc-load: thread %i: %s\n", t->index,
+			strerror(errno));
+		return -1;
+	}
+	return n;
+}
+
+static void *load_thread(void *arg)
+{
+	struct load_thread *t = arg;
+	struct load_stats *st = &t->st;
+	struct minipc_ch *ch[LOAD_MAX_CONN];
+	struct load_req *pend[LOAD_MAX_CONN], *r;
+	struct pollfd pfd[LOAD_MAX_CONN];
+	struct timespec ts;
+	uint64_t period, next, end, now, wait;
+	int i, k, s, n, inflight = 0;
+	uint32_t seq;
+
+	st->min = ~0ULL;
+	for (i = 0; i < load_nconn; i++) {
+		ch[i] = minipc_client_create(load_name,
+					     MINIPC_FLAG_MSG_NOSIGNAL);
+		pend[i] = calloc(LOAD_PENDING, sizeof(*pend[i]));
+		if (!ch[i] || !pend[i]) {
+			fprintf(stderr, "minipc-load: client_create(%s): %s\n",
+				load_name, strerror(errno));
+			exit(1);
+		}
+		pfd[i].fd = minipc_fileno(ch[i]);
+		pfd[i].events = POLLIN;
+		/* never block in send: the server may be blocked on us */
+		fcntl(pfd[i].fd, F_SETFL,
+		      fcntl(pfd[i].fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	/* threads are out of phase, so the total rate is even */
+	period = 1000000000ULL * load_nthreads / load_rate;
+	next = load_t0 + period * t->index / load_nthreads;
+	end = load_t0 + load_secs * 1000000000ULL;
+	for (n = 0; ; ) {
+		now = load_now();
+		if (now >= end && (!inflight
+				   || now >= end + load_timeout * 1000000ULL))
+			break;
+		for (; next <= now && next < end; next += period, n++) {
+			k = n % load_nconn;
+			s = n % load_nsig;
+			if (pfd[k].fd < 0) {
+				st->errors++;
+				continue;
+			}
+			if (minipc_call_sendv(ch[k], load_timeout,
+					      load_sigs[s].pd, &seq,
+					      load_sigs[s].argv) < 0) {
+				if (errno == EAGAIN)
+					st->dropped++; /* socket is full */
+				else
+					st->errors++;
+				continue;
+			}
+			st->sent++;
+			r = pend[k] + seq % LOAD_PENDING;
+			if (r->t) {
+				/* way too old, nobody answered */
+				st->timeouts++;
+				inflight--;
+			}
+			r->t = next;
+			r->seq = seq;
+			r->sig = s;
+			inflight++;
+		}
+
+		wait = next < end ? next : end + load_timeout * 1000000ULL;
+		wait = wait > now ? wait - now : 0;
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		if (ppoll(pfd, load_nconn, &ts, NULL) <= 0)
+			continue;
+		for (i = 0; i < load_nconn; i++) {
+			if (!pfd[i].revents)
+				continue;
+			k = load_recv(t, ch[i], pend[i]);
+			if (k < 0) {
+				pfd[i].fd = -1; /* connection lost */
+				continue;
+			}
+			inflight -= k;
+		}
+	}
+
+	/* what is still pending never got a reply */
+	for (i = 0; i < load_nconn; i++) {
+		for (k = 0; k < LOAD_PENDING; k++)
+			if (pend[i][k].t)
+				st->timeouts++;
+		minipc_close(ch[i]);
+		free(pend[i]);
+	}
+	return NULL;
+}
+
+static void load_report(struct load_stats *st, int histogram)
+{
+	static const double pct[] = {50, 90, 99, 99.9};
+	uint64_t count = 0;
+	int b, i = 0;
+
+	printf("offered %i req/s for %i s: sent %llu, dropped %llu\n",
+	       load_rate, load_secs, (unsigned long long)st->sent,
+	       (unsigned long long)st->dropped);
+	printf("ok %llu (%.1f req/s)\n", (unsigned long long)st->ok,
+	       (double)st->ok / load_secs);
+	printf("errors %llu local, %llu remote, %llu timeouts\n",
+	       (unsigned long long)st->errors,
+	       (unsigned long long)st->remote,
+	       (unsigned long long)st->timeouts);
+	if (!st->ok)
+		return;
+	printf("latency (us): min %llu", (unsigned long long)st->min);
+	for (b = 0; b < LOAD_NBUCKETS && i < 4; b++) {
+		count += st->hist[b];
+		while (i < 4 && count >= st->ok * pct[i] / 100) {
+			printf(", p%g %llu", pct[i],
+			       (unsigned long long)load_bucket_us(b));
+			i++;
+		}
+	}
+	printf(", max %llu\n", (unsigned long long)st->max);
+	if (!histogram)
+		return;
+	for (b = 0; b < LOAD_NBUCKETS; b++)
+		if (st->hist[b])
+			printf("  >= %8llu us: %llu\n",
+			       (unsigned long long)load_bucket_us(b),
+			       (unsigned long long)st->hist[b]);
+}
+
+static void load_usage(char *name)
+{
+	fprintf(stderr, "%s: Use \"%s [options] [<server> [<sig> ...]]\"\n"
+		"   -r <rate>     requests per second, total (1000)\n"
+		"   -d <secs>     duration (5)\n"
+		"   -t <threads>  sending threads (1)\n"
+		"   -c <conns>    connections per thread (1)\n"
+		"   -s <bytes>    length of string arguments (16)\n"
+		"   -T <ms>       timeout of each call (1000)\n"
+		"   -f <file>     read signatures from file, one per line\n"
+		"   -H            print the latency histogram\n"
+		" A signature is \"name:retval:args\", each type being one\n"
+		" of i (int), l (int64), d (double), s (string), S<n> (struct)\n"
+		" The default is the procedures of trivial-server\n",
+		name, name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct load_thread *t;
+	struct load_stats st;
+	char *sigfile = NULL;
+	char spec[64];
+	int i, b, c, histogram = 0;
+
+	while ((c = getopt(argc, argv, "r:d:t:c:s:T:f:H")) != -1) {
+		switch (c) {
+		case 'r': load_rate = atoi(optarg); break;
+		case 'd': load_secs = atoi(optarg); break;
+		case 't': load_nthreads = atoi(optarg); break;
+		case 'c': load_nconn = atoi(optarg); break;
+		case 's': load_strsize = atoi(optarg); break;
+		case 'T': load_timeout = atoi(optarg); break;
+		case 'f': sigfile = optarg; break;
+		case 'H': histogram = 1; break;
+		default: load_usage(argv[0]);
+		}
+	}
+	if (load_rate <= 0 || load_secs <= 0 || load_nthreads <= 0
+	    || load_nconn <= 0 || load_nconn > LOAD_MAX_CONN
+	    || load_strsize < 0 || load_timeout <= 0)
+		load_usage(argv[0]);
+
+	load_string = malloc(load_strsize + 1);
+	if (!load_string)
+		exit(1);
+	memset(load_string, 'x', load_strsize);
+	load_string[load_strsize] = '\0';
+
+	if (optind < argc)
+		load_name = argv[optind++];
+	for (; optind < argc; optind++)
+		if (load_add_sig(argv[optind]) < 0) {
+			fprintf(stderr, "%s: invalid signature \"%s\"\n",
+				argv[0], argv[optind]);
+			exit(1);
+		}
+	if (sigfile && load_read_sigs(sigfile) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], sigfile,
+			strerror(errno));
+		exit(1);
+	}
+	if (!load_nsig) {
+		load_add_sig(strdup("sum:i:ii"));
+		load_add_sig(strdup("sqrt:d:d"));
+		sprintf(spec, "gettimeofday:S%i:", (int)sizeof(struct timeval));
+		load_add_sig(strdup(spec));
+	}
+	printf("minipc-load: \"%s\", %i procedures, %i threads x %i "
+	       "connections\n", load_name, load_nsig, load_nthreads,
+	       load_nconn);
+
+	/* leave time to connect: all threads start together */
+	t = calloc(load_nthreads, sizeof(*t));
+	if (!t)
+		exit(1);
+	load_t0 = load_now() + 100 * 1000000ULL;
+	for (i = 0; i < load_nthreads; i++) {
+		t[i].index = i;
+		errno = pthread_create(&t[i].tid, NULL, load_thread, t + i);
+		if (errno) {
+			fprintf(stderr, "%s: pthread_create(): %s\n", argv[0],
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.min = ~0ULL;
+	for (i = 0; i < load_nthreads; i++) {
+		pthread_join(t[i].tid, NULL);
+		st.sent += t[i].st.sent;
+		st.dropped += t[i].st.dropped;
+		st.ok += t[i].st.ok;
+		st.errors += t[i].st.errors;
+		st.remote += t[i].st.remote;
+		st.timeouts += t[i].st.timeouts;
+		if (t[i].st.min < st.min)
+			st.min = t[i].st.min;
+		if (t[i].st.max > st.max)
+			st.max = t[i].st.max;
+		for (b = 0; b < LOAD_NBUCKETS; b++)
+			st.hist[b] += t[i].st.hist[b];
+	}
+	load_report(&st, histogram);
+	return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * Replay requests captured by a mini-ipc server, measuring latency
+ *
+ * Released in the public domain
+ *
+ * Each captured client gets its own connection, and requests leave at
+ * their original times (or scaled by the speed factor), whatever the
+ * replies do. Latency is measured from the scheduled time, and is
+ * reported together with the one the server recorded at capture time.
+ */
+#define _GNU_SOURCE /* ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "minipc.h"
+
+#define REPLAY_PENDING	4096	/* requests in flight, per connection */
+
+/* A request frame: name, flags, seq, deadline, then the argument words */
+#define REPLAY_REQ_HSIZE	(MINIPC_MAX_NAME + 3 * sizeof(uint32_t))
+#define REPLAY_REQ_MAX		(REPLAY_REQ_HSIZE \
+				 + MINIPC_MAX_ARGUMENTS * sizeof(uint32_t))
+
+struct replay_req {
+	struct minipc_capture_rec rec;
+	void *frame;
+};
+
+struct replay_pend {
+	uint64_t t;		/* scheduled time (ns), 0 if the entry is free */
+	uint32_t seq;
+};
+
+static struct replay_req *reqs;
+static int nreqs;
+static struct minipc_ch *ch[MINIPC_MAX_CLIENTS + 1];
+static struct pollfd pfd[MINIPC_MAX_CLIENTS + 1];
+static struct replay_pend *pend[MINIPC_MAX_CLIENTS + 1];
+
+static uint32_t *lat, *orig;	/* microseconds */
+static int nlat, norig, nsent, ndropped, nskipped, nerrors, nremote;
+static int ntimeouts;
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int replay_load(const char *fname)
+{
+	struct minipc_capture_hdr hdr;
+	struct replay_req *r;
+	FILE *f;
+	int n = 0, err;
+
+	f = fopen(fname, "r");
+	if (!f)
+		return -1;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1
+	    || hdr.magic != MINIPC_CAPTURE_MAGIC
+	    || hdr.version != MINIPC_CAPTURE_VERSION) {
+		fclose(f);
+		errno = EPROTO;
+		return -1;
+	}
+	while (1) {
+		if (nreqs == n) {
+			n = n ? 2 * n : 1024;
+			r = realloc(reqs, n * sizeof(*reqs));
+			if (!r)
+				goto out_free;
+			reqs = r;
+		}
+		r = reqs + nreqs;
+		if (fread(&r->rec, sizeof(r->rec), 1, f) != 1)
+			break;
+		/* the argument table is within the words, if any */
+		if (r->rec.reqsize < REPLAY_REQ_HSIZE
+		    || r->rec.reqsize > REPLAY_REQ_MAX) {
+			errno = EPROTO;
+			goto out_free;
+		}
+		r->frame = malloc(r->rec.reqsize);
+		if (!r->frame)
+			goto out_free;
+		if (fread(r->frame, r->rec.reqsize, 1, f) != 1) {
+			free(r->frame);
+			break; /* truncated: the server was killed */
+		}
+		nreqs++;
+	}
+	fclose(f);
+	return 0;
+
+out_free:
+	err = errno;
+	while (nreqs)
+		free(reqs[--nreqs].frame);
+	free(reqs);
+	reqs = NULL;
+	fclose(f);
+	errno = err;
+	return -1;
+}
+
+/* Connections are opened as captured clients show up */
+static int replay_conn(const char *name, int client)
+{
+	int k = client == MINIPC_CAPTURE_MEM ? MINIPC_MAX_CLIENTS
+		: client % MINIPC_MAX_CLIENTS;
+
+	if (ch[k])
+		return k;
+	ch[k] = minipc_client_create(name, MINIPC_FLAG_MSG_NOSIGNAL);
+	pend[k] = calloc(REPLAY_PENDING, sizeof(*pend[k]));
+	if (!ch[k] || !pend[k]) {
+		fprintf(stderr, "minipc-replay: client_create(%s): %s\n",
+			name, strerror(errno));
+		exit(1);
+	}
+	pfd[k].fd = minipc_fileno(ch[k]);
+	pfd[k].events = POLLIN;
+	/* never block in send: the server may be blocked on us */
+	fcntl(pfd[k].fd, F_SETFL, fcntl(pfd[k].fd, F_GETFL) | O_NONBLOCK);
+	return k;
+}
+
+static int replay_recv(int k, uint64_t timeout_ns)
+{
+	static uint8_t ret[MINIPC_MAX_REPLY];
+	struct replay_pend *p;
+	uint64_t ns;
+	uint32_t seq;
+	int n = 0;
+
+	while (minipc_call_recv(ch[k], &seq) == 0) {
+		p = pend[k] + seq % REPLAY_PENDING;
+		if (!seq || !p->t || p->seq != seq)
+			continue;
+		ns = replay_now() - p->t;
+		p->t = 0;
+		n++;
+		if (minipc_call_decode(ch[k], NULL, ret) < 0) {
+			if (errno == EREMOTEIO)
+				nremote++;
+			else
+				nerrors++;
+			continue;
+		}
+		if (ns > timeout_ns)
+			ntimeouts++;
+		else
+			lat[nlat++] = ns / 1000;
+	}
+	if (errno != EAGAIN) {
+		fprintf(stderr, "minipc-replay: connection %i: %s\n", k,
+			strerror(errno));
+		pfd[k].fd = -1;
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * Records are written as requests are served, which is not always the
+ * order they came in: sort by arrival, and never go back in time.
+ */
+static int replay_req_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((struct replay_req *)a)->rec.t_us;
+	uint64_t y = ((struct replay_req *)b)->rec.t_us;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t replay_offset(int i)
+{
+	int64_t us = (int64_t)(reqs[i].rec.t_us - reqs[0].rec.t_us);
+
+	return us > 0 ? us : 0;
+}
+
+static int replay_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void replay_percentiles(const char *what, uint32_t *v, int n)
+{
+	static const double pct[] = {50, 90, 99, 99.9};
+	int i;
+
+	if (!n)
+		return;
+	qsort(v, n, sizeof(*v), replay_cmp);
+	printf("%s (us): min %u", what, v[0]);
+	for (i = 0; i < 4; i++)
+		printf(", p%g %u", pct[i], v[(int)((n - 1) * pct[i] / 100)]);
+	printf(", max %u\n", v[n - 1]);
+}
+
+int main(int argc, char **argv)
+{
+	double speed = 1.0;
+	int i, k, c, timeout = 1000, inflight = 0;
+	uint64_t t0, next, now, wait, timeout_ns, end = 0;
+	struct replay_pend *p;
+	struct timespec ts;
+	uint32_t seq;
+
+	while ((c = getopt(argc, argv, "s:T:")) != -1) {
+		switch (c) {
+		case 's': speed = atof(optarg); break;
+		case 'T': timeout = atoi(optarg); break;
+		default: optind = argc; break;
+		}
+	}
+	if (optind != argc - 2 || speed < 0 || timeout <= 0) {
+		fprintf(stderr, "%s: Use \"%s [-s <speed>] [-T <ms>] "
+			"<server> <capture-file>\"\n"
+			"   -s <speed>  time scale, 0 is as fast as possible"
+			" (1)\n"
+			"   -T <ms>     timeout of each call (1000)\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+	if (replay_load(argv[optind + 1]) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind + 1],
+			strerror(errno));
+		exit(1);
+	}
+	if (!nreqs) {
+		fprintf(stderr, "%s: no requests captured\n", argv[0]);
+		exit(1);
+	}
+	qsort(reqs, nreqs, sizeof(*reqs), replay_req_cmp);
+	lat = calloc(nreqs, sizeof(*lat));
+	orig = calloc(nreqs, sizeof(*orig));
+	if (!lat || !orig)
+		exit(1);
+	for (i = 0; i < nreqs; i++) {
+		replay_conn(argv[optind], reqs[i].rec.client);
+		if (!reqs[i].rec.flags)
+			orig[norig++] = reqs[i].rec.wait_us
+				+ reqs[i].rec.service_us;
+	}
+	for (k = 0; k <= MINIPC_MAX_CLIENTS; k++)
+		if (!ch[k])
+			pfd[k].fd = -1;
+	printf("minipc-replay: %i requests, over %.3f s, at speed %g\n",
+	       nreqs, replay_offset(nreqs - 1) / 1e6, speed);
+
+	timeout_ns = timeout * 1000000ULL;
+	t0 = replay_now();
+	next = t0;
+	for (i = 0; ; ) {
+		now = replay_now();
+		if (i == nreqs && (!inflight || now >= end + timeout_ns))
+			break;
+		for (; i < nreqs && next <= now; i++) {
+			k = replay_conn(argv[optind], reqs[i].rec.client);
+			if (pfd[k].fd < 0) {
+				nerrors++;
+			} else if (reqs[i].rec.flags
+				   & MINIPC_CAPTURE_STREAM) {
+				nskipped++; /* we would owe it credit */
+			} else if (minipc_call_send_raw(ch[k], timeout,
+						reqs[i].frame,
+						reqs[i].rec.reqsize,
+						&seq) < 0) {
+				if (errno == EAGAIN)
+					ndropped++;
+				else
+					nerrors++;
+			} else if (reqs[i].rec.flags
+				   & MINIPC_CAPTURE_ONEWAY) {
+				nsent++; /* no reply will come */
+			} else {
+				nsent++;
+				p = pend[k] + seq % REPLAY_PENDING;
+				if (p->t) {
+					ntimeouts++;
+					inflight--;
+				}
+				p->t = next;
+				p->seq = seq;
+				inflight++;
+			}
+			end = next;
+			if (i + 1 < nreqs && speed > 0)
+				next = t0 + replay_offset(i + 1) * 1000
+					/ speed;
+		}
+
+		wait = i < nreqs ? next : end + timeout_ns;
+		wait = wait > now ? wait - now : 0;
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		if (ppoll(pfd, MINIPC_MAX_CLIENTS + 1, &ts, NULL) <= 0)
+			continue;
+		for (k = 0; k <= MINIPC_MAX_CLIENTS; k++) {
+			if (!pfd[k].revents)
+				continue;
+			c = replay_recv(k, timeout_ns);
+			if (c > 0)
+				inflight -= c;
+		}
+	}
+	for (k = 0; k <= MINIPC_MAX_CLIENTS; k++) {
+		if (!ch[k])
+			continue;
+		for (i = 0; i < REPLAY_PENDING; i++)
+			if (pend[k][i].t)
+				ntimeouts++;
+		minipc_close(ch[k]);
+	}
+
+	printf("sent %i, dropped %i, ok %i in %.3f s\n", nsent, ndropped,
+	       nlat, (replay_now() - t0) / 1e9);
+	if (nskipped)
+		printf("skipped %i stream requests\n", nskipped);
+	printf("errors %i local, %i remote, %i timeouts\n", nerrors, nremote,
+	       ntimeouts);
+	replay_percentiles("captured", orig, norig);
+	replay_percentiles("replayed", lat, nlat);
+	return 0;
+}
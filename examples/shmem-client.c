@@ -99,6 +99,53 @@ static int do_stat(struct minipc_ch *client, char **argv)
 	return 0;
 }
 
+/*
+ * Stat a file of ours again and again on the same channel, growing it
+ * by one byte each time: rpc_stat is a delta procedure, so after the
+ * first call the replies only carry what changed. Check every value
+ * we decode against a local stat of the same file.
+ */
+static int do_statloop(struct minipc_ch *client, char **argv)
+{
+	char fname[] = "/tmp/shmem-client-XXXXXX";
+	struct stat stbuf, local;
+	int i, fd, ret = 0, n = atoi(argv[2]), saved_errno;
+
+	fd = mkstemp(fname);
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (write(fd, "", 1) != 1) {
+			ret = -1;
+			break;
+		}
+		ret = minipc_call(client, CLIENT_TIMEOUT, &rpc_stat, &stbuf,
+				  fname);
+		if (ret < 0)
+			break;
+		if (stat(fname, &local) < 0) {
+			ret = -1;
+			break;
+		}
+		if (memcmp(&stbuf, &local, sizeof(local))) {
+			fprintf(stderr, "stat(\"%s\"): call %i: wrong value"
+				" (size %li, expected %li)\n", fname, i,
+				(long)stbuf.st_size, (long)local.st_size);
+			errno = EPROTO;
+			ret = -1;
+			break;
+		}
+	}
+	saved_errno = errno;
+	close(fd);
+	unlink(fname);
+	errno = saved_errno;
+	if (ret < 0)
+		return ret;
+	printf("stat(\"%s\") %i times: all values match\n", fname, n);
+	return 0;
+}
+
 /*
  * This is a parsing table for argv[1]
  */
@@ -113,6 +160,7 @@ struct {
 	{ "strlen", do_strlen, 3},
 	{ "strcat", do_strcat, 4},
 	{ "stat", do_stat, 3},
+	{ "statloop", do_statloop, 3},
 	{NULL, },
 };
 
@@ -36,11 +36,8 @@ static int shm_server_do_getenv(const struct minipc_pd *pd,
 static int shm_server_do_setenv(const struct minipc_pd *pd,
 			       uint32_t *args, void *ret)
 {
-	char *envname = (void *)args;
-	char *envval;
-
-	args = minipc_get_next_arg(args, pd->args[0]);
-	envval = (void *)args;
+	char *envname = minipc_get_arg(pd, args, 0, NULL);
+	char *envval = minipc_get_arg(pd, args, 1, NULL);
 
 	setenv(envname, envval, 1);
 	return 0;
@@ -75,16 +72,17 @@ static int shm_server_do_strcat(const struct minipc_pd *pd,
 			       uint32_t *args, void *ret)
 {
 	char *s, *t;
-	char scat[256];
-
-	s = (void *)args;
-	args = minipc_get_next_arg(args, pd->args[0]);
-	t = (void *)args;
-
-	strncpy(scat, s, sizeof(scat));
-	strncat(scat, t, sizeof(scat) - strlen(s));
+	int slen, tlen;
 
-	strcpy(ret, scat); /* FIXME: max size */
+	/* the lengths come with the request: no need to scan */
+	s = minipc_get_arg(pd, args, 0, &slen);
+	t = minipc_get_arg(pd, args, 1, &tlen);
+	if (slen + tlen >= MINIPC_MAX_REPLY) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	memcpy(ret, s, slen);
+	memcpy((char *)ret + slen, t, tlen + 1);
 	return 0;
 }
 
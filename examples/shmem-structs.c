@@ -30,6 +30,7 @@ struct minipc_pd rpc_getenv = {
 /* run setenv in the server */
 struct minipc_pd rpc_setenv = {
 	.name = "setenv",
+	.flags = MINIPC_PD_FLAG_ONEWAY, /* nothing to report back */
 	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
 	.args = {
 		MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRING, char *),
@@ -68,12 +69,12 @@ struct minipc_pd rpc_strcat = {
 	},
 };
 
-/* run "stat" on a file name */
+/* run "stat" on a file name: often the same one, so only get changes */
 struct minipc_pd rpc_stat = {
 	.name = "stat",
+	.flags = MINIPC_PD_FLAG_DELTA,
 	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRUCT, struct stat),
 	.args = {
-		MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRING, char *),
 		MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRING, char *),
 		MINIPC_ARG_END,
 	},
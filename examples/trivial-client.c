@@ -45,14 +45,41 @@ const struct minipc_pd ss_sqrt_struct = {
 	},
 };
 
+const struct minipc_pd ss_mean_struct = {
+	.name = "mean",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_DOUBLE, double),
+	.args = {
+		MINIPC_ARG_ARRAY(MINIPC_ATYPE_DOUBLE, double),
+		MINIPC_ARG_END,
+	},
+};
+
+const struct minipc_pd ss_squares_struct = {
+	.name = "squares",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+	.args = {
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_END,
+	},
+};
+
+const struct minipc_pd ss_loops_struct = {
+	.name = "loops",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+	.args = {
+		MINIPC_ARG_END,
+	},
+};
+
 int main(int argc, char **argv)
 {
 	struct minipc_ch *client;
-	int a, b, c, ret;
+	int a, b, c, i, ret;
+	long long total;
 	struct timeval tv;
-	double rt_in, rt_out;
+	double rt_in, rt_out, v[100];
 
-	client = minipc_client_create("trivial", 0);
+	client = minipc_client_create("trivial", MINIPC_FLAG_STATE);
 	if (!client) {
 		fprintf(stderr, "%s: client_create(): %s\n", argv[0],
 			strerror(errno));
@@ -96,6 +123,41 @@ int main(int argc, char **argv)
 	printf("sqrt(%lf) = %lf\n", rt_in, rt_out);
 	usleep(500*1000);
 
+	/* an array is passed as pointer and count, in a single copy */
+	for (i = 0; i < 100; i++)
+		v[i] = i + 1;
+	ret = minipc_call(client, TRIVIAL_TIMEOUT, &ss_mean_struct, &rt_out,
+			  v, 100);
+	if (ret < 0) {
+		goto error;
+	}
+	printf("mean(1..100) = %lf\n", rt_out);
+	usleep(500*1000);
+
+	/* a stream: many values for one request, read as they come */
+	a = 10000;
+	ret = minipc_stream_open(client, TRIVIAL_TIMEOUT, &ss_squares_struct,
+				 0, a);
+	if (ret < 0) {
+		goto error;
+	}
+	for (i = 0, total = 0; (ret = minipc_stream_next(client,
+				TRIVIAL_TIMEOUT, &c)) > 0; i++)
+		total += c;
+	minipc_stream_close(client);
+	if (ret < 0) {
+		goto error;
+	}
+	printf("squares(%i): %i values, sum %lli\n", a, i, total);
+	usleep(500*1000);
+
+	/* published state: read from shared memory, not a call */
+	ret = minipc_state_read(client, TRIVIAL_TIMEOUT, &ss_loops_struct, &c);
+	if (ret < 0) {
+		goto error;
+	}
+	printf("server loops: %i\n", c);
+
 	return 0;
 
  error:
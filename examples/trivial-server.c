@@ -53,8 +53,68 @@ static int ss_sqrt_function(const struct minipc_pd *pd,
 	return 0;
 }
 
+static int ss_mean_function(const struct minipc_pd *pd,
+			    uint32_t *args, void *ret)
+{
+	double *v, sum = 0;
+	int i, n;
+
+	/* the array is a pointer and a length, in bytes */
+	v = minipc_get_arg(pd, args, 0, &n);
+	if (!v)
+		return -1;
+	n /= sizeof(*v);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	*(double *)ret = n ? sum / n : 0;
+	return 0;
+}
+
+/* The squares of 0..n-1, streamed: the producer keeps its own state */
+struct ss_squares {
+	int i, n;
+};
+
+static int ss_squares_next(struct minipc_deferred *d, void *arg,
+			   void *retval)
+{
+	struct ss_squares *sq = arg;
+
+	if (!retval || sq->i == sq->n) {
+		free(sq);
+		return 0;
+	}
+	*(int *)retval = sq->i * sq->i;
+	sq->i++;
+	return 1;
+}
+
+static int ss_squares_function(const struct minipc_pd *pd,
+			       uint32_t *args, void *ret)
+{
+	struct minipc_deferred *d;
+	struct ss_squares *sq;
 
-/* Describe the three functions above */
+	sq = malloc(sizeof(*sq));
+	if (!sq)
+		return -1;
+	sq->i = 0;
+	sq->n = args[0];
+	d = minipc_defer();
+	if (!d) {
+		free(sq);
+		return -1;
+	}
+	if (minipc_stream_reply(d, ss_squares_next, sq) < 0) {
+		/* not a stream client: tell it */
+		minipc_reply(d, errno, NULL);
+		free(sq);
+	}
+	return 0;
+}
+
+
+/* Describe the functions above */
 const struct minipc_pd ss_sum_struct = {
 	.f = ss_sum_function,
 	.name = "sum",
@@ -85,9 +145,40 @@ const struct minipc_pd ss_sqrt_struct = {
 	},
 };
 
+const struct minipc_pd ss_mean_struct = {
+	.f = ss_mean_function,
+	.name = "mean",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_DOUBLE, double),
+	.args = {
+		MINIPC_ARG_ARRAY(MINIPC_ATYPE_DOUBLE, double),
+		MINIPC_ARG_END,
+	},
+};
+
+const struct minipc_pd ss_squares_struct = {
+	.f = ss_squares_function,
+	.name = "squares",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+	.args = {
+		MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+		MINIPC_ARG_END,
+	},
+};
+
+/* Not exported: published as state, that clients read with no call */
+const struct minipc_pd ss_loops_struct = {
+	.name = "loops",
+	.retval = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int),
+	.args = {
+		MINIPC_ARG_END,
+	},
+};
+
 int main(int argc, char **argv)
 {
 	struct minipc_ch *server;
+	FILE *capture = NULL;
+	int loops = 0;
 
 	server = minipc_server_create("trivial", 0);
 	if (!server) {
@@ -99,12 +190,28 @@ int main(int argc, char **argv)
 	minipc_export(server, &ss_sum_struct);
 	minipc_export(server, &ss_tod_struct);
 	minipc_export(server, &ss_sqrt_struct);
+	minipc_export(server, &ss_mean_struct);
+	minipc_export(server, &ss_squares_struct);
+
+	/* If so asked, record all requests, for minipc-replay */
+	if (argc > 1) {
+		capture = fopen(argv[1], "w");
+		if (!capture || minipc_server_capture(server, capture) < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1],
+				strerror(errno));
+			exit(1);
+		}
+	}
 	while (1) {
+		minipc_state_publish(server, &ss_loops_struct, &loops);
+		loops++;
 		if (minipc_server_action(server, 1000) < 0) {
 			fprintf(stderr, "%s: server_action(): %s\n", argv[0],
 				strerror(errno));
 			exit(1);
 		}
+		if (capture)
+			fflush(capture);
 		fprintf(stdout, "%s: looping...\n", __func__);
 	}
 }
@@ -10,6 +10,7 @@
  *   the Free Software Foundation; either version 2 of the License, or
  *   (at your option) any later version.
  */
+#define _GNU_SOURCE /* memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,148 +19,369 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 
 #include "minipc-int.h"
+#include "minipc-trace.h"
 
-struct minipc_ch *minipc_client_create(const char *name, int f)
+/*
+ * Create a memfd, map it and pass it to the server. Any failure
+ * just leaves the link without arena, as it would be without the flag.
+ */
+static void mpc_client_arena(struct mpc_link *link)
 {
-	return __minipc_link_create(name, MPC_USER_FLAGS(f) | MPC_FLAG_CLIENT);
+	struct mpc_req_packet req = {"",};
+	struct mpc_rep_packet rep;
+	struct mpc_arena *arena;
+	struct pollfd pfd;
+	int fd, ret;
+
+	fd = memfd_create("minipc-arena", MFD_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	if (ftruncate(fd, mpc_arena_size()) < 0)
+		goto out_close;
+	arena = mpc_arena_map(fd);
+	if (!arena)
+		goto out_close;
+
+	req.flags = MPC_REQ_ARENA_SETUP;
+	if (mpc_send_fds(link->ch.fd, &req, MPC_REQ_HSIZE, MSG_NOSIGNAL,
+			 &fd, 1) < 0)
+		goto out_unmap;
+	pfd.fd = link->ch.fd;
+	pfd.events = POLLIN | POLLHUP;
+	if (poll(&pfd, 1, MPC_TIMEOUT) <= 0)
+		goto out_unmap;
+	ret = recv(link->ch.fd, &rep, sizeof(rep), 0);
+	if (ret < (int)(MPC_REP_HSIZE + sizeof(int))
+	    || MINIPC_GET_ATYPE(rep.type) == MINIPC_ATYPE_ERROR)
+		goto out_unmap;
+	close(fd);
+	link->arena = arena;
+	if (link->logf)
+		fprintf(link->logf, "%s: using arena %p\n", __func__, arena);
+	return;
+
+ out_unmap:
+	mpc_arena_unmap(arena);
+ out_close:
+	close(fd);
+ out:
+	if (link->logf)
+		fprintf(link->logf, "%s: no arena: %s\n", __func__,
+			strerror(errno));
 }
 
-int minipc_call(struct minipc_ch *ch, int millisec_timeout,
-		const struct minipc_pd *pd, void *ret, ...)
+/*
+ * Ask for the fd of the published state, and map it read-only. As for
+ * the arena, failures leave the link without it: reads are calls then.
+ */
+static void mpc_client_state(struct mpc_link *link)
 {
-	struct mpc_link *link = mpc_get_link(ch);
-	struct mpc_shmem *shm = link->memaddr;
-	int flags = link->flags;
+	struct mpc_req_packet req = {"",};
+	struct mpc_rep_packet rep;
+	struct mpc_state *state;
 	struct pollfd pfd;
-	int i, narg, size, retsize, pollnr;
-	int atype, asize;
-	va_list ap;
-	struct mpc_req_packet *p_out, _pkt_out = {"",};
-	struct mpc_rep_packet *p_in, _pkt_in;
+	int fds[MINIPC_MAX_FDS], nfds = 0, ret;
 
-	CHECK_LINK(link);
+	req.flags = MPC_REQ_STATE_SETUP | MPC_REQ_ASYNC;
+	if (send(link->ch.fd, &req, MPC_REQ_HSIZE, MSG_NOSIGNAL) < 0)
+		goto out;
+	pfd.fd = link->ch.fd;
+	pfd.events = POLLIN | POLLHUP;
+	if (poll(&pfd, 1, MPC_TIMEOUT) <= 0)
+		goto out;
+	ret = mpc_recv_fds(link->ch.fd, &rep, sizeof(rep), 0, fds, &nfds);
+	if (ret < (int)(MPC_REP_HSIZE + sizeof(int))
+	    || MINIPC_GET_ATYPE(rep.type) != MINIPC_ATYPE_FD || nfds != 1) {
+		errno = EPROTO; /* or an older server */
+		goto out_close;
+	}
+	state = mmap(0, mpc_state_size(), PROT_READ, MAP_SHARED, fds[0], 0);
+	if (state == MAP_FAILED)
+		goto out_close;
+	close(fds[0]);
+	if (state->magic != MPC_STATE_MAGIC
+	    || state->version != MPC_STATE_VERSION) {
+		munmap(state, mpc_state_size());
+		errno = EPROTO;
+		goto out;
+	}
+	link->state = state;
+	if (link->logf)
+		fprintf(link->logf, "%s: using state %p\n", __func__, state);
+	return;
 
-	if (shm) {
-		p_out = &shm->request;
-		p_in = &shm->reply;
-	} else {
-		p_out = & _pkt_out;
-		p_in = & _pkt_in;
+ out_close:
+	while (nfds)
+		close(fds[--nfds]);
+ out:
+	if (link->logf)
+		fprintf(link->logf, "%s: no state: %s\n", __func__,
+			strerror(errno));
+}
+
+struct minipc_ch *minipc_client_create(const char *name, int f)
+{
+	struct minipc_ch *ch;
+
+	ch = __minipc_link_create(name, MPC_USER_FLAGS(f) | MPC_FLAG_CLIENT);
+	if (ch && (f & MINIPC_FLAG_ARENA) && !mpc_get_link(ch)->memaddr)
+		mpc_client_arena(mpc_get_link(ch));
+	if (ch && (f & MINIPC_FLAG_STATE) && !mpc_get_link(ch)->memaddr)
+		mpc_client_state(mpc_get_link(ch));
+	return ch;
+}
+
+/*
+ * Wait for a memory channel to post our reply: events on the fd only
+ * tell that something changed, so check the slot each time
+ */
+static int mpc_mem_wait(struct mpc_link *link, struct mpc_shmem_slot *slot,
+			uint32_t seq, uint32_t deadline)
+{
+	struct pollfd pfd;
+	int ms = -1;
+
+	pfd.fd = link->ch.fd;
+	pfd.events = POLLIN;
+	while (mpc_load_acquire(&slot->nreply) != seq) {
+		if (deadline) {
+			ms = (int32_t)(deadline - mpc_now_ms());
+			if (ms < 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		pfd.revents = 0;
+		if (poll(&pfd, 1, ms) < 0 && errno != EINTR)
+			return -1;
+		if (pfd.revents)
+			mpc_mem_ack(link);
 	}
+	return 0;
+}
 
-	/* Build the packet to send out -- marshall args */
-	if (link->logf) {
-		fprintf(link->logf, "%s: calling \"%s\"\n",
-			__func__, pd->name);
+/* Sequence numbers are never 0: a reply with seq 0 is a refusal */
+static uint32_t mpc_next_seq(struct mpc_link *link)
+{
+	if (!++link->seq)
+		link->seq++;
+	return link->seq;
+}
+
+/* The server drops the request if it can't answer in time */
+static uint32_t mpc_deadline(int millisec_timeout)
+{
+	uint32_t deadline;
+
+	if (millisec_timeout < 0)
+		return 0;
+	deadline = mpc_now_ms() + millisec_timeout;
+	if (!deadline)
+		deadline++; /* 0 means "no deadline" */
+	return deadline;
+}
+
+/* Plans are compiled at the first call of each pd, and kept by the link */
+static struct mpc_plan *mpc_plan_get(struct mpc_link *link,
+				     const struct minipc_pd *pd)
+{
+	struct mpc_plan **head, *plan;
+
+	head = link->plan + ((uintptr_t)pd / sizeof(void *)) % MPC_PLAN_HASH;
+	for (plan = *head; plan; plan = plan->next)
+		if (plan->pd == pd)
+			return plan;
+	plan = mpc_plan_compile(link, pd);
+	if (!plan)
+		return NULL;
+	plan->next = *head;
+	*head = plan;
+	return plan;
+}
+
+/* Values come from the va_list, or from argv for minipc_call_sendv() */
+#define mpc_arg(type) (argv ? *(type *)argv[i] : va_arg(*ap, type))
+#define mpc_arg_ptr() (argv ? argv[i] : va_arg(*ap, void *))
+
+/*
+ * Marshall the arguments into the packet, following the plan. Returns
+ * the number of argument words, or -1 with errno set. Padding is
+ * cleared, as the packet is not.
+ */
+static int mpc_marshall(struct mpc_link *link, const struct mpc_plan *plan,
+			struct mpc_req_packet *p_out, int *fds, int *nfds,
+			va_list *ap, void * const *argv)
+{
+	const struct mpc_plan_step *step = plan->step;
+	uint32_t *args = p_out->args;
+	int i, narg, len, alen, ntab = 0;
+
+	/* Only scalars: offsets are known and everything fits */
+	if (plan->flags & MPC_PLAN_SCALAR) {
+		for (i = 0; i < plan->nsteps; i++, step++) {
+			if (step->atype == MINIPC_ATYPE_INT)
+				args[step->off] = mpc_arg(int);
+			else if (step->atype == MINIPC_ATYPE_INT64)
+				*(uint64_t *)(args + step->off)
+					= mpc_arg(uint64_t);
+			else
+				*(double *)(args + step->off)
+					= mpc_arg(double);
+		}
+		return plan->nwords;
 	}
-	memcpy(p_out->name, pd->name, MINIPC_MAX_NAME);
 
-	va_start(ap, ret);
-	for (i = narg = 0; ; i++) {
-		int next_narg = narg;
+	if ((plan->flags & MPC_PLAN_FD) && link->memaddr) {
+		/* the fd goes out-of-band, the packet has its index */
+		if (link->logf)
+			fprintf(link->logf, "%s: can't pass fd in memory\n",
+				__func__);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
 
-		atype = MINIPC_GET_ATYPE(pd->args[i]);
-		asize = MINIPC_GET_ASIZE(pd->args[i]);
-		next_narg += MINIPC_GET_ANUM(asize);
-		if (next_narg >= MINIPC_MAX_ARGUMENTS) /* unlikely */
+	/* the offset table, if any, comes first */
+	if (plan->flags & MPC_PLAN_ARGTAB) {
+		p_out->flags |= MPC_REQ_ARGTAB;
+		ntab = plan->nsteps;
+	}
+	for (i = 0, narg = ntab; i < plan->nsteps; i++, step++) {
+		/* after a string, the size must be checked at each step */
+		if (i > plan->nfixed
+		    && narg + step->nwords >= MINIPC_MAX_ARGUMENTS)
 			goto doesnt_fit;
+		len = step->asize;
+		alen = step->nwords;
 
-		switch (atype) {
-		case MINIPC_ATYPE_NONE:
-			goto out; /* end of list */
+		switch (step->atype) {
 		case MINIPC_ATYPE_INT:
-			p_out->args[narg++] = va_arg(ap, int);
+			args[narg] = mpc_arg(int);
 			break;
 		case MINIPC_ATYPE_INT64:
-			*(uint64_t *)(p_out->args + narg)
-				= va_arg(ap, uint64_t);
-			narg = next_narg;
+			*(uint64_t *)(args + narg) = mpc_arg(uint64_t);
 			break;
 		case MINIPC_ATYPE_DOUBLE:
-			*(double *)(p_out->args + narg) = va_arg(ap, double);
-			narg = next_narg;
+			*(double *)(args + narg) = mpc_arg(double);
 			break;
 		case MINIPC_ATYPE_STRING:
 		{
-			char *sin = va_arg(ap, void *);
-			char *sout = (void *)(p_out->args + narg);
-			int slen = strlen(sin);
-			int alen;
-
-			/*
-			 * argument len is arbitrary, terminate and 4-align
-			 * we can't use next_narg here, as len changes
-			 */
-			alen = MINIPC_GET_ANUM(slen + 1);
+			char *sin = mpc_arg_ptr();
+
+			/* argument len is arbitrary, terminate and 4-align */
+			len = strlen(sin);
+			alen = MINIPC_GET_ANUM(len + 1);
 			if (narg + alen >= MINIPC_MAX_ARGUMENTS)
 				goto doesnt_fit;
-			strcpy(sout, sin);
-			narg += alen;
+			args[narg + alen - 1] = 0;
+			memcpy(args + narg, sin, len + 1);
 			break;
 		}
 		case MINIPC_ATYPE_STRUCT:
-			memcpy(p_out->args + narg, va_arg(ap, void *), asize);
-			narg = next_narg;
+			if (alen)
+				args[narg + alen - 1] = 0;
+			memcpy(args + narg, mpc_arg_ptr(), len);
 			break;
+		case MINIPC_ATYPE_ARRAY:
+		{
+			const void *ain;
+			int count, d;
+
+			if (argv) {
+				const struct minipc_array *a = argv[i];
 
-		default:
-			if (link->logf) {
-				fprintf(link->logf, "%s: unkown type 0x%x\n",
-					__func__, atype);
+				ain = a->data;
+				count = a->count;
+			} else {
+				ain = va_arg(*ap, void *);
+				count = va_arg(*ap, int);
 			}
-			errno = EPROTO;
-			return -1;
+			/* count word, padding, then the data in one copy */
+			if (count < 0 || count > MINIPC_MAX_ARGUMENTS * 4)
+				goto doesnt_fit;
+			len = count * step->asize;
+			d = mpc_array_data(narg);
+			alen = d - narg + MINIPC_GET_ANUM(len);
+			if (narg + alen >= MINIPC_MAX_ARGUMENTS)
+				goto doesnt_fit;
+			args[narg] = count;
+			memset(args + narg + 1, 0,
+			       (d - narg - 1) * sizeof(*args));
+			if (len & 3)
+				args[narg + alen - 1] = 0;
+			memcpy(args + d, ain, len);
+			break;
+		}
+		case MINIPC_ATYPE_FD:
+			if (*nfds == MINIPC_MAX_FDS)
+				goto doesnt_fit;
+			fds[*nfds] = mpc_arg(int);
+			args[narg] = (*nfds)++;
+			break;
 		}
+		if (ntab)
+			args[i] = (narg - ntab) | (len << 16);
+		narg += alen;
 	}
- out:
-	va_end(ap);
+	return narg;
 
-	if (shm) {
-		char b[10];
-		/* flush the file, in case previous read went timeout */
-		read(ch->fd, b, sizeof(b)); /* EAGAIN if all goes well */
-		shm->nrequest++;
-	} else {
-		int send_flags = 0;
+doesnt_fit:
+	if (link->logf) {
+		fprintf(link->logf, "%s: rpc call \"%s\" won't fit %i slots\n",
+			__func__, plan->pd->name, MINIPC_MAX_ARGUMENTS);
+	}
+	errno = EPROTO;
+	return -1;
+}
 
-		/* if MINIPC_FLAG_MSG_NOSIGNAL is set, pass MSG_NOSIGNAL to
-		 * a send function */
-		if (flags & MINIPC_FLAG_MSG_NOSIGNAL)
-			send_flags |= MSG_NOSIGNAL;
+/* Receive a reply from the socket: a returned fd replaces the value */
+static int mpc_recv_reply(struct mpc_link *link, struct mpc_rep_packet *p_in,
+			  int flags)
+{
+	int fds[MINIPC_MAX_FDS], nfds, i = 0, retsize;
 
-		size = sizeof(p_out->name) + sizeof(p_out->args[0]) * narg;
-		if (send(ch->fd, p_out, size, send_flags) < 0) {
-			/* errno already set */
-			return -1;
-		}
+	retsize = mpc_recv_fds(link->ch.fd, p_in, sizeof(*p_in), flags,
+			       fds, &nfds);
+	if (retsize >= (int)MPC_REP_HSIZE
+	    && MINIPC_GET_ATYPE(p_in->type) == MINIPC_ATYPE_FD) {
+		if (nfds)
+			*(int *)&p_in->val = fds[i++];
+		else
+			retsize = MPC_REP_HSIZE; /* too short, later */
 	}
+	/* extra ones are closed */
+	while (i < nfds)
+		close(fds[i++]);
+	return retsize;
+}
 
-	/* Wait for the reply packet */
-	pfd.fd = ch->fd;
-	pfd.events = POLLIN | POLLHUP;
-	pfd.revents = 0;
-	pollnr = poll(&pfd, 1, millisec_timeout);
-	if (pollnr < 0) {
-		/* errno already set */
-		return -1;
-	}
-	if (pollnr == 0) {
-		errno = ETIMEDOUT;
-		return -1;
-	}
+/* A reply nobody will look at: release the fd it may carry */
+static void mpc_drop_reply(struct mpc_rep_packet *p_in)
+{
+	if (MINIPC_GET_ATYPE(p_in->type) == MINIPC_ATYPE_FD)
+		close(*(int *)&p_in->val);
+}
+
+/* Check the reply packet and copy the return value for the caller */
+static int mpc_decode(struct mpc_link *link, const struct minipc_pd *pd,
+		      struct mpc_rep_packet *p_in, int retsize, void *ret)
+{
+	/* this "size" is wrong for strings, it's only the minimum */
+	int size = MPC_REP_HSIZE;
+
+	mpc_trace4(call_reply, mpc_trace_name(pd ? pd->name : NULL),
+		   link->ch.fd, p_in->seq,
+		   MINIPC_GET_ATYPE(p_in->type) == MINIPC_ATYPE_ERROR
+		   ? *(int *)&p_in->val : 0);
+
+	/* without a pd (replay tools), any type is accepted */
+	if (pd)
+		size += MINIPC_GET_ASIZE(pd->retval);
 
-	if (shm) {
-		read(ch->fd, &i, 1);
-		size = retsize = sizeof(shm->reply);
-	} else {
-		/* this "size" is wrong for strings, so recv the max size */
-		size = MINIPC_GET_ASIZE(pd->retval) + sizeof(uint32_t);
-		retsize = recv(ch->fd, p_in, sizeof(*p_in), 0);
-	}
 	/* if very short, we have a problem */
-	if (retsize < (sizeof(p_in->type)) + sizeof(int))
+	if (retsize < MPC_REP_HSIZE + sizeof(int))
 		goto too_short;
 	/* remote error reported */
 	if (MINIPC_GET_ATYPE(p_in->type) == MINIPC_ATYPE_ERROR) {
@@ -174,11 +396,13 @@ int minipc_call(struct minipc_ch *ch, int millisec_timeout,
 		return -1;
 	}
 	/* another check: the return type must match */
-	if (MINIPC_GET_ATYPE(p_in->type) != MINIPC_GET_ATYPE(pd->retval)) {
+	if (pd && MINIPC_GET_ATYPE(p_in->type)
+	    != MINIPC_GET_ATYPE(pd->retval)) {
 		if (link->logf) {
 			fprintf(link->logf, "%s: wrong code %08x (not %08x)\n",
 				__func__, p_in->type, pd->retval);
 		}
+		mpc_drop_reply(p_in);
 		errno = EPROTO;
 		return -1;
 	}
@@ -196,12 +420,636 @@ too_short:
 	}
 	errno = EPROTO;
 	return -1;
+}
 
-doesnt_fit:
+/* Delta procedures: apply the changes to the last value, or keep a new one */
+static int mpc_delta_decode(struct mpc_link *link, struct mpc_plan *plan,
+			    struct mpc_rep_packet *p_in, int retsize,
+			    void *ret)
+{
+	int size = MINIPC_GET_ASIZE(plan->pd->retval);
+	int n = MINIPC_GET_ASIZE(p_in->type);
+
+	if (retsize < MPC_REP_HSIZE || !(p_in->flags & MPC_REP_DELTA)) {
+		if (mpc_decode(link, plan->pd, p_in, retsize, ret) < 0)
+			return -1;
+		/* a whole value: the server tells its generation, if any */
+		if (!plan->cache)
+			plan->cache = malloc(size);
+		plan->gen = plan->cache ? p_in->unused & 0xffff : 0;
+		if (plan->gen)
+			memcpy(plan->cache, ret, size);
+		return 0;
+	}
+	mpc_trace4(call_reply, mpc_trace_name(plan->pd->name), link->ch.fd,
+		   p_in->seq, 0);
+	if (!plan->gen || retsize < MPC_REP_HSIZE + n
+	    || mpc_delta_apply(plan->cache, size, p_in->val, n) < 0) {
+		if (link->logf)
+			fprintf(link->logf, "%s: bad delta reply (gen %i)\n",
+				__func__, plan->gen);
+		plan->gen = 0; /* the next reply will be whole */
+		errno = EPROTO;
+		return -1;
+	}
+	plan->gen = p_in->unused;
+	memcpy(ret, plan->cache, size);
+	return 0;
+}
+
+/*
+ * A memory server of the other byte order gets its numbers swapped by
+ * us, both ways. Strings and structures (also in arrays) are bytes, and
+ * are left alone. The offset table is swapped last, after being used.
+ */
+static void mpc_swab_request(const struct mpc_plan *plan,
+			     struct mpc_req_packet *p)
+{
+	const struct mpc_plan_step *step = plan->step;
+	uint32_t *args = p->args;
+	int i, off, etype, ntab = 0;
+
+	if (plan->flags & MPC_PLAN_ARGTAB)
+		ntab = plan->nsteps;
+	for (i = 0; i < plan->nsteps; i++, step++) {
+		if (ntab)
+			off = ntab + MPC_ARGTAB_OFF(args[i]);
+		else if (i < plan->nfixed)
+			off = step->off;
+		else
+			off = plan->nwords; /* the final string or array */
+
+		switch (step->atype) {
+		case MINIPC_ATYPE_INT:
+			args[off] = mpc_swab32(args[off]);
+			break;
+		case MINIPC_ATYPE_INT64:
+		case MINIPC_ATYPE_DOUBLE:
+			mpc_swab64_array(args + off, 1);
+			break;
+		case MINIPC_ATYPE_ARRAY:
+			etype = MINIPC_GET_ETYPE(plan->pd->args[i]);
+			if (etype == MINIPC_ATYPE_INT)
+				mpc_swab32_array(args + mpc_array_data(off),
+						 args[off]);
+			else if (etype != MINIPC_ATYPE_STRUCT)
+				mpc_swab64_array(args + mpc_array_data(off),
+						 args[off]);
+			args[off] = mpc_swab32(args[off]);
+			break;
+		}
+	}
+	mpc_swab32_array(args, ntab);
+	p->flags = mpc_swab32(p->flags);
+	p->seq = mpc_swab32(p->seq);
+	p->deadline = mpc_swab32(p->deadline);
+}
+
+static void mpc_swab_reply(struct mpc_rep_packet *p)
+{
+	p->type = mpc_swab32(p->type);
+	p->flags = mpc_swab32(p->flags);
+	p->seq = mpc_swab32(p->seq);
+	switch (MINIPC_GET_ATYPE(p->type)) {
+	case MINIPC_ATYPE_ERROR:
+	case MINIPC_ATYPE_INT:
+		mpc_swab32_array((uint32_t *)p->val, 1);
+		break;
+	case MINIPC_ATYPE_INT64:
+	case MINIPC_ATYPE_DOUBLE:
+		mpc_swab64_array((uint32_t *)p->val, 1);
+		break;
+	}
+}
+
+int minipc_call(struct minipc_ch *ch, int millisec_timeout,
+		const struct minipc_pd *pd, void *ret, ...)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_shmem *shm = link->memaddr;
+	struct mpc_shmem_slot *slot = NULL;
+	struct mpc_plan *plan;
+	int flags = link->flags;
+	int oneway = pd->flags & MINIPC_PD_FLAG_ONEWAY;
+	struct pollfd pfd;
+	int i, narg, size, retsize, pollnr, swap = 0, delta;
+	int fds[MINIPC_MAX_FDS], nfds = 0;
+	uint32_t seq, deadline;
+	va_list ap;
+	struct mpc_req_packet *p_out, _pkt_out;
+	struct mpc_rep_packet *p_in, _pkt_in;
+
+	CHECK_LINK(link);
+
+	plan = mpc_plan_get(link, pd);
+	if (!plan)
+		return -1;
+	if (shm) {
+		if (!mpc_shmem_check(shm)) {
+			if (link->logf)
+				fprintf(link->logf, "%s: bad memory layout "
+					"(version %i, %i slots)\n", __func__,
+					shm->version, shm->nslots);
+			errno = EPROTO;
+			return -1;
+		}
+		/* the slot is still busy if a previous call went timeout */
+		swap = mpc_shmem_swapped(shm);
+		seq = (swap ? mpc_swab32(shm->nrequest) : shm->nrequest) + 1;
+		slot = mpc_shmem_slot(shm, seq);
+		if (mpc_load_acquire(&slot->nreply) != slot->nrequest) {
+			errno = EBUSY;
+			return -1;
+		}
+		p_out = &slot->request;
+		p_in = &slot->reply;
+	} else {
+		seq = mpc_next_seq(link);
+		/* the arena is busy until the server reads the request */
+		p_out = link->arena && !oneway ? &link->arena->request
+			: & _pkt_out;
+		p_in = & _pkt_in;
+	}
+	deadline = mpc_deadline(millisec_timeout);
+
+	/* Build the packet to send out -- marshall args */
 	if (link->logf) {
-		fprintf(link->logf, "%s: rpc call \"%s\" won't fit %i slots\n",
-			__func__, pd->name, MINIPC_MAX_ARGUMENTS);
+		fprintf(link->logf, "%s: calling \"%s\"\n",
+			__func__, pd->name);
 	}
-	errno = EPROTO;
-	return -1;
+	memcpy(p_out->name, pd->name, MINIPC_MAX_NAME);
+	p_out->flags = flags & MINIPC_FLAG_PRIO(0xf);
+	if (oneway)
+		p_out->flags |= MPC_REQ_ONEWAY;
+	/* tell which value we have, to only get what changed since then */
+	delta = (pd->flags & MINIPC_PD_FLAG_DELTA) && !oneway && !swap
+		&& MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_STRUCT;
+	if (delta)
+		p_out->flags |= MPC_REQ_DELTA | plan->gen << 16;
+	p_out->seq = seq;
+	p_out->deadline = deadline;
+
+	va_start(ap, ret);
+	narg = mpc_marshall(link, plan, p_out, fds, &nfds, &ap, NULL);
+	va_end(ap);
+	if (narg < 0)
+		return -1;
+
+	size = MPC_REQ_HSIZE + sizeof(p_out->args[0]) * narg;
+	mpc_trace4(call_send, mpc_trace_name(pd->name), ch->fd, seq, size);
+	if (shm) {
+		if (swap)
+			mpc_swab_request(plan, p_out);
+		/* as the server counts */
+		slot->nrequest = swap ? mpc_swab32(seq) : seq;
+		mpc_store_release(&shm->nrequest, slot->nrequest);
+		mpc_trace1(shm_request, seq);
+		if (link->doorbell)
+			link->doorbell(ch);
+	} else {
+		int send_flags = 0;
+
+		/* if MINIPC_FLAG_MSG_NOSIGNAL is set, pass MSG_NOSIGNAL to
+		 * a send function */
+		if (flags & MINIPC_FLAG_MSG_NOSIGNAL)
+			send_flags |= MSG_NOSIGNAL;
+
+		/* a big packet in the arena is only notified by the header */
+		if (link->arena && size > MPC_ARENA_THRESHOLD) {
+			p_out->flags |= MPC_REQ_ARENA;
+			size = MPC_REQ_HSIZE;
+		}
+		if (mpc_send_fds(ch->fd, p_out, size, send_flags,
+				 fds, nfds) < 0) {
+			/* a refused client finds the reason in the socket */
+			if (errno != EPIPE && errno != ECONNRESET)
+				return -1;
+			retsize = recv(ch->fd, p_in, sizeof(*p_in),
+				       MSG_DONTWAIT);
+			if (retsize < (int)MPC_REP_HSIZE || p_in->seq != 0) {
+				errno = EPIPE;
+				return -1;
+			}
+			return mpc_decode(link, pd, p_in, retsize, ret);
+		}
+	}
+
+	/* One-way: done as soon as the request is out */
+	if (oneway)
+		return 0;
+
+	/* Wait for the reply packet */
+	if (shm) {
+		/* the poller may have slowed down while we were idle */
+		mpc_poll_kick(link);
+		if (mpc_mem_wait(link, slot, slot->nrequest, deadline) < 0) {
+			if (errno == ETIMEDOUT)
+				mpc_trace3(call_timeout,
+					   mpc_trace_name(pd->name),
+					   ch->fd, seq);
+			return -1;
+		}
+		if (swap)
+			mpc_swab_reply(p_in);
+		if (delta)
+			return mpc_delta_decode(link, plan, p_in,
+						sizeof(*p_in), ret);
+		return mpc_decode(link, pd, p_in, sizeof(*p_in), ret);
+	}
+	pfd.fd = ch->fd;
+	pfd.events = POLLIN | POLLHUP;
+ wait_reply:
+	pfd.revents = 0;
+	i = -1;
+	if (deadline) {
+		i = (int32_t)(deadline - mpc_now_ms());
+		if (i < 0)
+			i = 0;
+	}
+	pollnr = poll(&pfd, 1, i);
+	if (pollnr < 0) {
+		/* errno already set */
+		return -1;
+	}
+	if (pollnr == 0) {
+		/* the server may still use the arena: never touch it again */
+		if (link->arena) {
+			mpc_arena_unmap(link->arena);
+			link->arena = NULL;
+		}
+		mpc_trace3(call_timeout, mpc_trace_name(pd->name), ch->fd, seq);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	retsize = mpc_recv_reply(link, p_in, 0);
+	if (retsize < 0)
+		return -1;
+	/* The reply to a call that timed out earlier: discard it */
+	if (retsize >= MPC_REP_HSIZE && p_in->seq != seq && p_in->seq != 0) {
+		mpc_drop_reply(p_in);
+		link->stats.stale++;
+		if (link->logf)
+			fprintf(link->logf, "%s: stale reply %i (not %i)\n",
+				__func__, p_in->seq, seq);
+		goto wait_reply;
+	}
+	if (retsize >= MPC_REP_HSIZE && (p_in->flags & MPC_REP_ARENA)
+	    && link->arena) {
+		p_in = &link->arena->reply;
+		retsize = sizeof(*p_in);
+	}
+	if (delta)
+		return mpc_delta_decode(link, plan, p_in, retsize, ret);
+	return mpc_decode(link, pd, p_in, retsize, ret);
+}
+
+/*
+ * Asynchronous calls, for sockets only: the caller sends requests
+ * and later collects replies, matching them by sequence number.
+ * These never use the arena, which has room for one call only.
+ */
+static int mpc_call_send(struct mpc_link *link, int millisec_timeout,
+			 const struct minipc_pd *pd, uint32_t *seq, int flags,
+			 va_list *ap, void * const *argv)
+{
+	struct mpc_req_packet pkt;
+	struct mpc_plan *plan;
+	int fds[MINIPC_MAX_FDS], nfds = 0;
+	int narg, size, send_flags = 0;
+
+	if (link->memaddr) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	plan = mpc_plan_get(link, pd);
+	if (!plan)
+		return -1;
+	if (link->logf) {
+		fprintf(link->logf, "%s: calling \"%s\"\n",
+			__func__, pd->name);
+	}
+	memcpy(pkt.name, pd->name, MINIPC_MAX_NAME);
+	pkt.flags = (link->flags & MINIPC_FLAG_PRIO(0xf)) | MPC_REQ_ASYNC
+		| flags;
+	if (pd->flags & MINIPC_PD_FLAG_ONEWAY)
+		pkt.flags |= MPC_REQ_ONEWAY;
+	pkt.seq = mpc_next_seq(link);
+	pkt.deadline = mpc_deadline(millisec_timeout);
+
+	narg = mpc_marshall(link, plan, &pkt, fds, &nfds, ap, argv);
+	if (narg < 0)
+		return -1;
+
+	if (link->flags & MINIPC_FLAG_MSG_NOSIGNAL)
+		send_flags |= MSG_NOSIGNAL;
+	size = MPC_REQ_HSIZE + sizeof(pkt.args[0]) * narg;
+	mpc_trace4(call_send, mpc_trace_name(pd->name), link->ch.fd, pkt.seq, size);
+	if (mpc_send_fds(link->ch.fd, &pkt, size, send_flags, fds, nfds) < 0)
+		return -1;
+	*seq = pkt.seq;
+	return 0;
+}
+
+int minipc_call_send(struct minipc_ch *ch, int millisec_timeout,
+		     const struct minipc_pd *pd, uint32_t *seq, ...)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	va_list ap;
+	int ret;
+
+	CHECK_LINK(link);
+
+	va_start(ap, seq);
+	ret = mpc_call_send(link, millisec_timeout, pd, seq, 0, &ap, NULL);
+	va_end(ap);
+	return ret;
+}
+
+/* For generic tools: argv[i] points to the value (strings: the string) */
+int minipc_call_sendv(struct minipc_ch *ch, int millisec_timeout,
+		      const struct minipc_pd *pd, uint32_t *seq,
+		      void * const *argv)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+
+	return mpc_call_send(link, millisec_timeout, pd, seq, 0, NULL, argv);
+}
+
+/* Replay a request captured by a server: only seq and deadline change */
+int minipc_call_send_raw(struct minipc_ch *ch, int millisec_timeout,
+			 const void *req, int size, uint32_t *seq)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_req_packet pkt;
+	int send_flags = 0;
+
+	CHECK_LINK(link);
+
+	if (link->memaddr) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (size < (int)MPC_REQ_HSIZE || size > (int)sizeof(pkt)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&pkt, req, size);
+	pkt.flags &= ~(MPC_REQ_ARENA | MPC_REQ_ARENA_SETUP);
+	pkt.flags |= MPC_REQ_ASYNC;
+	/* we have no cached value: ask for the whole one */
+	if (pkt.flags & MPC_REQ_DELTA)
+		pkt.flags &= 0xffff & ~MPC_REQ_DELTA;
+	pkt.seq = mpc_next_seq(link);
+	pkt.deadline = mpc_deadline(millisec_timeout);
+
+	if (link->flags & MINIPC_FLAG_MSG_NOSIGNAL)
+		send_flags |= MSG_NOSIGNAL;
+	mpc_trace4(call_send, mpc_trace_name(pkt.name), ch->fd, pkt.seq, size);
+	if (mpc_send_fds(ch->fd, &pkt, size, send_flags, NULL, 0) < 0)
+		return -1;
+	*seq = pkt.seq;
+	return 0;
+}
+
+/* Receive one reply, without blocking (EAGAIN if none is there yet) */
+int minipc_call_recv(struct minipc_ch *ch, uint32_t *seq)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	int retsize;
+
+	CHECK_LINK(link);
+
+	if (link->memaddr) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (!link->reply) {
+		link->reply = malloc(sizeof(*link->reply));
+		if (!link->reply)
+			return -1;
+	}
+	/* the previous one was never decoded */
+	if (link->replysize)
+		mpc_drop_reply(link->reply);
+	link->replysize = 0;
+
+	retsize = mpc_recv_reply(link, link->reply, MSG_DONTWAIT);
+	if (retsize < 0)
+		return -1;
+	if (retsize == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (retsize < MPC_REP_HSIZE) {
+		errno = EPROTO;
+		return -1;
+	}
+	link->replysize = retsize;
+	*seq = link->reply->seq;
+	return 0;
+}
+
+/* Return the value of the reply just received, as minipc_call does */
+int minipc_call_decode(struct minipc_ch *ch, const struct minipc_pd *pd,
+		       void *ret)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	int retsize;
+
+	CHECK_LINK(link);
+
+	retsize = link->replysize;
+	if (!retsize) {
+		errno = ENOMSG;
+		return -1;
+	}
+	link->replysize = 0;
+	return mpc_decode(link, pd, link->reply, retsize, ret);
+}
+
+/*
+ * Streams: the request carries an initial credit (in values), and the
+ * server sends no more than that many values ahead of us. Credit is
+ * given back every half window, so a fast reader never stalls it.
+ */
+static int mpc_stream_credit(struct mpc_link *link, int flags, int n)
+{
+	struct mpc_req_packet pkt;
+	int size = MPC_REQ_HSIZE + sizeof(pkt.args[0]);
+	int send_flags = 0;
+
+	memset(&pkt, 0, size);
+	memcpy(pkt.name, link->cstream.pd->name, MINIPC_MAX_NAME);
+	pkt.flags = MPC_REQ_CREDIT | flags;
+	pkt.seq = link->cstream.seq;
+	pkt.args[0] = n;
+	if (link->flags & MINIPC_FLAG_MSG_NOSIGNAL)
+		send_flags |= MSG_NOSIGNAL;
+	return send(link->ch.fd, &pkt, size, send_flags) < 0 ? -1 : 0;
+}
+
+int minipc_stream_open(struct minipc_ch *ch, int millisec_timeout,
+		       const struct minipc_pd *pd, int window, ...)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_cstream *cs = &link->cstream;
+	va_list ap;
+	int ret;
+
+	CHECK_LINK(link);
+
+	if (cs->state == MPC_CSTREAM_OPEN) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (pd->flags & MINIPC_PD_FLAG_ONEWAY) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (window <= 0)
+		window = MINIPC_STREAM_WINDOW;
+	if (window > 0xffff)
+		window = 0xffff;
+	va_start(ap, window);
+	ret = mpc_call_send(link, millisec_timeout, pd, &cs->seq,
+			    MPC_REQ_STREAM | (window << 16), &ap, NULL);
+	va_end(ap);
+	if (ret < 0)
+		return ret;
+	cs->pd = pd;
+	cs->window = window;
+	cs->consumed = 0;
+	cs->state = MPC_CSTREAM_OPEN;
+	return 0;
+}
+
+/* Return 1 with the next value, 0 at the end, -1 on error */
+int minipc_stream_next(struct minipc_ch *ch, int millisec_timeout, void *ret)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_cstream *cs = &link->cstream;
+	struct mpc_rep_packet p_in;
+	struct pollfd pfd;
+	int retsize;
+
+	CHECK_LINK(link);
+
+	if (cs->state == MPC_CSTREAM_ENDED)
+		return 0;
+	if (cs->state != MPC_CSTREAM_OPEN) {
+		errno = EINVAL;
+		return -1;
+	}
+	pfd.fd = ch->fd;
+	pfd.events = POLLIN | POLLHUP;
+	while (1) {
+		pfd.revents = 0;
+		retsize = poll(&pfd, 1, millisec_timeout);
+		if (retsize < 0)
+			return -1;
+		if (retsize == 0) {
+			/* still open: the caller may wait more, or close */
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		retsize = mpc_recv_reply(link, &p_in, 0);
+		if (retsize < 0)
+			return -1;
+		if (retsize == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (retsize < MPC_REP_HSIZE) {
+			errno = EPROTO;
+			return -1;
+		}
+		/* seq 0 is a refused connection */
+		if (p_in.seq == cs->seq || p_in.seq == 0)
+			break;
+		mpc_drop_reply(&p_in);
+		link->stats.stale++;
+	}
+
+	if (!(p_in.flags & MPC_REP_MORE)) {
+		cs->state = MPC_CSTREAM_ENDED;
+		if ((p_in.flags & MPC_REP_END)
+		    && MINIPC_GET_ATYPE(p_in.type) != MINIPC_ATYPE_ERROR)
+			return 0;
+		/* an error, or a function that replied only once */
+		if (mpc_decode(link, cs->pd, &p_in, retsize, ret) < 0)
+			return -1;
+		return 1;
+	}
+	if (mpc_decode(link, cs->pd, &p_in, retsize, ret) < 0)
+		return -1;
+	if (++cs->consumed >= (cs->window + 1) / 2) {
+		if (mpc_stream_credit(link, 0, cs->consumed) < 0)
+			return -1;
+		cs->consumed = 0;
+	}
+	return 1;
+}
+
+/* Done with the stream: if it is not over, the server stops it */
+int minipc_stream_close(struct minipc_ch *ch)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_cstream *cs = &link->cstream;
+	int ret = 0;
+
+	CHECK_LINK(link);
+
+	if (cs->state == MPC_CSTREAM_OPEN)
+		ret = mpc_stream_credit(link, MPC_REQ_CANCEL, 0);
+	cs->state = 0;
+	return ret;
+}
+
+/*
+ * Published state: copy the value under the seqlock, with no syscall.
+ * If it's not there (not mapped, or not published yet), or the server
+ * seems to have died while writing it, this is a plain call.
+ */
+int minipc_state_read(struct minipc_ch *ch, int millisec_timeout,
+		      const struct minipc_pd *pd, void *ret)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_state_block *b = NULL;
+	struct mpc_plan *plan;
+	int i, size = MINIPC_GET_ASIZE(pd->retval);
+	uint32_t seq;
+
+	CHECK_LINK(link);
+
+	if (!mpc_state_pd(pd)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (link->state) {
+		plan = mpc_plan_get(link, pd);
+		if (!plan)
+			return -1;
+		if (!plan->state) {
+			b = mpc_state_find(link->state, pd->name);
+			if (b && b->type == pd->retval
+			    && b->off + size <= (uint32_t)mpc_state_size())
+				plan->state = b;
+		}
+		b = plan->state;
+	}
+	for (i = 0; b && i < MPC_STATE_RETRIES; i++) {
+		seq = mpc_load_acquire(&b->seq);
+		if (seq & 1)
+			continue;
+		memcpy(ret, (uint8_t *)link->state + b->off, size);
+		mpc_fence_acquire();
+		if (*(volatile uint32_t *)&b->seq == seq) {
+			mpc_trace3(state_read, mpc_trace_name(pd->name), ch->fd, i);
+			return 0;
+		}
+	}
+	return minipc_call(ch, millisec_timeout, pd, ret);
 }
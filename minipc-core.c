@@ -13,19 +13,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/shm.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "minipc-int.h"
 
+/* Links may be created and closed by several threads at once */
 struct mpc_link *__mpc_base;
+static pthread_mutex_t mpc_base_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mpc_base_once = PTHREAD_ONCE_INIT;
+
+/* Nor must a fork leave the lock taken in the child */
+static void mpc_base_prepare(void)
+{
+	pthread_mutex_lock(&mpc_base_lock);
+}
+
+static void mpc_base_release(void)
+{
+	pthread_mutex_unlock(&mpc_base_lock);
+}
+
+static void mpc_base_init(void)
+{
+	pthread_atfork(mpc_base_prepare, mpc_base_release, mpc_base_release);
+}
 
 static int __mpc_poll_usec = MINIPC_DEFAULT_POLL;
 
@@ -47,39 +71,307 @@ void mpc_free_flist(struct mpc_link *link, struct mpc_flist *flist)
 	if (link->logf)
 		fprintf(link->logf, "%s: unexported function %p (%s)\n",
 			__func__, flist->pd->f, flist->pd->name);
+	free(flist->plan);
 	free(flist);
 }
 
+/* Arrays are made of int, int64, double or structs: check the element */
+static int mpc_array_check(struct mpc_link *link, const struct minipc_pd *pd,
+			   int asize)
+{
+	int esize = MINIPC_GET_ESIZE(asize);
+
+	switch (MINIPC_GET_ETYPE(asize)) {
+	case MINIPC_ATYPE_INT:
+		if (esize == sizeof(int))
+			return 0;
+		break;
+	case MINIPC_ATYPE_INT64:
+	case MINIPC_ATYPE_DOUBLE:
+		if (esize == 8)
+			return 0;
+		break;
+	case MINIPC_ATYPE_STRUCT:
+		if (esize)
+			return 0;
+		break;
+	}
+	if (link->logf)
+		fprintf(link->logf, "%s: \"%s\": bad array element 0x%x\n",
+			__func__, pd->name, asize);
+	return -1;
+}
+
+/*
+ * Compile the arguments of a pd into a plan: type errors and the
+ * size of fixed arguments are checked once, not at each call
+ */
+struct mpc_plan *mpc_plan_compile(struct mpc_link *link,
+				  const struct minipc_pd *pd)
+{
+	struct mpc_plan *plan;
+	struct mpc_plan_step *step;
+	int i, n, atype, asize;
+
+	for (n = 0; MINIPC_GET_ATYPE(pd->args[n]) != MINIPC_ATYPE_NONE; n++)
+		;
+	plan = calloc(1, sizeof(*plan) + n * sizeof(plan->step[0]));
+	if (!plan)
+		return NULL;
+	plan->pd = pd;
+	plan->nsteps = plan->nfixed = n;
+	plan->flags = MPC_PLAN_SCALAR;
+
+	for (i = 0, step = plan->step; i < n; i++, step++) {
+		atype = MINIPC_GET_ATYPE(pd->args[i]);
+		asize = MINIPC_GET_ASIZE(pd->args[i]);
+		switch (atype) {
+		case MINIPC_ATYPE_INT:
+			asize = sizeof(int);
+			break;
+		case MINIPC_ATYPE_INT64:
+		case MINIPC_ATYPE_DOUBLE:
+			break;
+		case MINIPC_ATYPE_STRING:
+			asize = 0;
+			if (plan->nfixed == n)
+				plan->nfixed = i;
+			plan->flags &= ~MPC_PLAN_SCALAR;
+			break;
+		case MINIPC_ATYPE_STRUCT:
+			plan->flags &= ~MPC_PLAN_SCALAR;
+			break;
+		case MINIPC_ATYPE_FD:
+			asize = sizeof(int);
+			plan->flags &= ~MPC_PLAN_SCALAR;
+			plan->flags |= MPC_PLAN_FD;
+			break;
+		case MINIPC_ATYPE_ARRAY:
+			if (mpc_array_check(link, pd, asize) < 0)
+				goto err;
+			asize = MINIPC_GET_ESIZE(asize);
+			if (plan->nfixed == n)
+				plan->nfixed = i;
+			plan->flags &= ~MPC_PLAN_SCALAR;
+			break;
+		default:
+			if (link->logf)
+				fprintf(link->logf, "%s: \"%s\": unknown type "
+					"0x%x\n", __func__, pd->name, atype);
+			goto err;
+		}
+		step->atype = atype;
+		step->asize = asize;
+		step->nwords = mpc_atype_variable(atype) ? 0
+			: MINIPC_GET_ANUM(asize);
+		if (i < plan->nfixed) {
+			step->off = plan->nwords;
+			plan->nwords += step->nwords;
+		}
+	}
+	if (mpc_argtab_size(pd)) {
+		plan->flags |= MPC_PLAN_ARGTAB;
+		plan->nwords += n;
+	}
+	if (plan->nwords >= MINIPC_MAX_ARGUMENTS) {
+		if (link->logf)
+			fprintf(link->logf, "%s: rpc call \"%s\" won't fit %i "
+				"slots\n", __func__, pd->name,
+				MINIPC_MAX_ARGUMENTS);
+		goto err;
+	}
+	return plan;
+ err:
+	free(plan);
+	errno = EPROTO;
+	return NULL;
+}
+
+/*
+ * Delta replies: the ranges of a value that changed since the copy both
+ * sides keep. Each range is a word like those of the argument table, then
+ * the bytes, padded to 4. Ranges are word-aligned, and merged across
+ * gaps no longer than a header. Returns the length, or -1 if not shorter
+ * than the value itself.
+ */
+static int mpc_word_differs(const uint8_t *a, const uint8_t *b, int i,
+			    int size)
+{
+	return memcmp(a + i, b + i, size - i < 4 ? size - i : 4) != 0;
+}
+
+int mpc_delta_encode(const void *old, const void *new, int size, void *out)
+{
+	const uint8_t *a = old, *b = new;
+	uint8_t *p = out;
+	uint32_t w;
+	int i, j, end, len, n = 0;
+
+	for (i = 0; i < size; i = end) {
+		while (i < size && !mpc_word_differs(a, b, i, size))
+			i += 4;
+		if (i >= size)
+			break;
+		for (j = end = i + 4; j < size && j < end + 8; j += 4)
+			if (mpc_word_differs(a, b, j, size))
+				end = j + 4;
+		if (end > size)
+			end = size;
+		len = end - i;
+		if (n + 4 + ((len + 3) & ~3) >= size)
+			return -1;
+		w = i | len << 16;
+		memcpy(p + n, &w, sizeof(w));
+		memcpy(p + n + 4, b + i, len);
+		memset(p + n + 4 + len, 0, ((len + 3) & ~3) - len);
+		n += 4 + ((len + 3) & ~3);
+	}
+	return n;
+}
+
+int mpc_delta_apply(void *val, int size, const void *delta, int n)
+{
+	const uint8_t *p = delta;
+	uint32_t w;
+	int i, off, len;
+
+	for (i = 0; i + 4 <= n; i += 4 + ((len + 3) & ~3)) {
+		memcpy(&w, p + i, sizeof(w));
+		off = MPC_ARGTAB_OFF(w);
+		len = MPC_ARGTAB_LEN(w);
+		if (off + len > size || i + 4 + len > n) {
+			errno = EPROTO;
+			return -1;
+		}
+		memcpy((uint8_t *)val + off, p + i + 4, len);
+	}
+	return 0;
+}
+
+void mpc_delta_free(struct mpc_delta **head)
+{
+	struct mpc_delta *d;
+
+	while ((d = *head)) {
+		*head = d->next;
+		free(d);
+	}
+}
+
+/*
+ * Byte swapping of arrays: sixteen bytes at a time, if we can. Bytes
+ * are swapped in each 16-bit half, then the halves are reordered.
+ */
+#ifdef __SSE2__
+static inline __m128i mpc_swab16_vec(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+void mpc_swab32_array(uint32_t *p, int n)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((void *)(p + i));
+
+		v = mpc_swab16_vec(v);
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((void *)(p + i), v);
+	}
+#endif
+	for (; i < n; i++)
+		p[i] = mpc_swab32(p[i]);
+}
+
+void mpc_swab64_array(uint32_t *p, int n)
+{
+	uint32_t w;
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i + 2 <= n; i += 2) {
+		__m128i v = _mm_loadu_si128((void *)(p + 2 * i));
+
+		v = mpc_swab16_vec(v);
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_si128((void *)(p + 2 * i), v);
+	}
+#endif
+	for (; i < n; i++) {
+		w = p[2 * i];
+		p[2 * i] = mpc_swab32(p[2 * i + 1]);
+		p[2 * i + 1] = mpc_swab32(w);
+	}
+}
+
+static void mpc_poll_del(struct mpc_link *link);
+
 int minipc_close(struct minipc_ch *ch)
 {
 	struct mpc_link *link = mpc_get_link(ch);
 	struct mpc_link **nextp;
+	struct mpc_plan *plan;
+	int i;
 
 	CHECK_LINK(link);
 
 	/* Look for link in our list */
+	pthread_mutex_lock(&mpc_base_lock);
 	for (nextp = &__mpc_base; (*nextp); nextp = &(*nextp)->nextl)
 		if (*nextp == link)
 			break;
 
 	if (!*nextp) {
+		pthread_mutex_unlock(&mpc_base_lock);
 		errno = ENOENT;
 		return -1;
 	}
 
 	(*nextp) = link->nextl;
+	pthread_mutex_unlock(&mpc_base_lock);
 
 	if (link->logf) {
 		fprintf(link->logf, "%s: found link %p (fd %i)\n",
 			__func__, link, link->ch.fd);
 	}
+	mpc_fd_event(link, ch->fd, 0);
+	if (link->pollv)
+		mpc_poll_del(link);
 	close(ch->fd);
-	if (link->pid)
-		kill(link->pid, SIGINT);
 	if (link->flags & MPC_FLAG_SHMEM)
 		shmdt(link->memaddr);
-	if (link->flags & MPC_FLAG_DEVMEM)
+	if (link->flags & (MPC_FLAG_DEVMEM | MPC_FLAG_UIO))
 		munmap(link->memaddr, link->memsize);
+	if (link->arena)
+		mpc_arena_unmap(link->arena);
+	if (link->state)
+		munmap(link->state, mpc_state_size());
+	if (link->state && (link->flags & MPC_FLAG_SERVER))
+		close(link->statefd);
+	free(link->reply);
+	for (i = 0; i < MPC_PLAN_HASH; i++)
+		while ((plan = link->plan[i])) {
+			link->plan[i] = plan->next;
+			free(plan->cache);
+			free(plan);
+		}
+	if (link->flags & MPC_FLAG_SERVER)
+		for (i = 0; i < MINIPC_MAX_CLIENTS; i++) {
+			if (link->client[i].fd >= 0) {
+				mpc_fd_event(link, link->client[i].fd, 0);
+				close(link->client[i].fd);
+			}
+			if (link->client[i].arena)
+				mpc_arena_unmap(link->client[i].arena);
+			free(link->client[i].req);
+			mpc_delta_free(&link->client[i].delta);
+		}
+	mpc_delta_free(&link->delta);
 
 	/* Release allocated functions */
 	while (link->flist)
@@ -110,39 +402,387 @@ int minipc_set_logfile(struct minipc_ch *ch, FILE *logf)
 	return 0;
 }
 
-/* the child for memory-based channels just polls */
-void __minipc_child(void *addr, int fd, int flags)
+int minipc_get_stats(struct minipc_ch *ch, struct minipc_stats *stats)
 {
-	int i;
-	uint32_t prev, *vptr;
-	struct mpc_shmem *shm = addr;
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
 
-	for (i = 0; i < 256; i++)
-		if (i != fd) close(i);
+	*stats = link->stats;
+	return 0;
+}
 
-	/* check the parent: if it changes, then we exit */
-	i = getppid();
+/* Time of CLOCK_MONOTONIC, shared by all processes of this host */
+uint64_t mpc_now_us(void)
+{
+	struct timespec ts;
 
-	/* the process must only send one byte when the value changes */
-	if (flags & MPC_FLAG_SERVER)
-		vptr = &shm->nrequest;
-	else
-		vptr = &shm->nreply;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+uint32_t mpc_now_ms(void)
+{
+	return mpc_now_us() / 1000;
+}
 
-	prev = *vptr;
+/*
+ * Socket helpers that pass file descriptors together with a packet.
+ * The fds travel as ancillary data of the first byte, so packet
+ * boundaries are preserved like with plain send/recv.
+ */
+int mpc_send_fds(int fd, const void *buf, int len, int flags,
+		 const int *fds, int nfds)
+{
+	struct msghdr msg = {0,};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int) * MINIPC_MAX_FDS)];
+
+	if (!nfds)
+		return send(fd, buf, len, flags);
+	if (nfds > MINIPC_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	return sendmsg(fd, &msg, flags);
+}
 
-	/* Ok, unlock the parent: we are ready */
-	write(fd, "-", 1);
+/* Received fds are stored in fds[] (MINIPC_MAX_FDS max), count in *nfds */
+int mpc_recv_fds(int fd, void *buf, int len, int flags, int *fds, int *nfds)
+{
+	struct msghdr msg = {0,};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int) * MINIPC_MAX_FDS)];
+	int ret, n;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	*nfds = 0;
+	ret = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+		return ret;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (*nfds + n > MINIPC_MAX_FDS) /* can't happen: ctrunc */
+			n = MINIPC_MAX_FDS - *nfds;
+		memcpy(fds + *nfds, CMSG_DATA(cmsg), n * sizeof(int));
+		*nfds += n;
+	}
+	return ret;
+}
 
-	while (1) {
-		if (*vptr != prev) {
-			write(fd, "", 1);
-			prev++;
+/* The arena is a memfd mapped by both sides, passed at connect time */
+int mpc_arena_size(void)
+{
+	int pagesize = getpagesize();
+
+	return (sizeof(struct mpc_arena) + pagesize - 1) & ~(pagesize - 1);
+}
+
+struct mpc_arena *mpc_arena_map(int fd)
+{
+	void *addr;
+
+	addr = mmap(0, mpc_arena_size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	return addr;
+}
+
+void mpc_arena_unmap(struct mpc_arena *arena)
+{
+	munmap(arena, mpc_arena_size());
+}
+
+/* Published state is a memfd too, written by the server alone */
+int mpc_state_size(void)
+{
+	int pagesize = getpagesize();
+
+	return (sizeof(struct mpc_state) + pagesize - 1) & ~(pagesize - 1);
+}
+
+struct mpc_state_block *mpc_state_find(struct mpc_state *state,
+				       const char *name)
+{
+	int i, n = mpc_load_acquire(&state->nblocks);
+
+	for (i = 0; i < n && i < MINIPC_MAX_STATE; i++)
+		if (!strncmp(state->block[i].name, name, MINIPC_MAX_NAME))
+			return state->block + i;
+	return NULL;
+}
+
+int minipc_set_doorbell(struct minipc_ch *ch, minipc_doorbell_f *f)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+	if (!link->memaddr) {
+		errno = EINVAL;
+		return -1;
+	}
+	link->doorbell = f;
+	return 0;
+}
+
+/*
+ * The fd of memory channels is readable after some event: consume it.
+ * The poller thread signals an eventfd, UIO counts interrupts and
+ * needs to be re-enabled. Both fds are non-blocking.
+ */
+void mpc_mem_ack(struct mpc_link *link)
+{
+	uint32_t buf[4], on = 1;
+
+	if (link->flags & MPC_FLAG_UIO) {
+		if (read(link->ch.fd, buf, sizeof(buf[0])) > 0)
+			write(link->ch.fd, &on, sizeof(on));
+		return;
+	}
+	while (read(link->ch.fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Memory channels are watched by a single thread: at each pass it looks
+ * at the counter of every channel (nrequest for servers, nreply for
+ * clients) and signals the eventfd of those that changed. The thread is
+ * started with the first channel and exits after the last one is closed.
+ *
+ * Each channel is polled on its own schedule: at the minimum interval
+ * after a change, then twice as late at each idle pass, up to the
+ * maximum. A client posting a request brings its channel back to the
+ * minimum at once, as the reply should come soon.
+ */
+static pthread_mutex_t mpc_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mpc_poll_cond;
+static pthread_once_t mpc_poll_once = PTHREAD_ONCE_INIT;
+static struct mpc_link *mpc_poll_list;
+static int mpc_poll_running;
+
+/* Channels with no range of their own use the global interval */
+static int mpc_poll_interval(struct mpc_link *link)
+{
+	int min = link->poll_min, max = link->poll_max;
+
+	if (!min)
+		return __mpc_poll_usec;
+	if (min << link->poll_level > max)
+		return max;
+	return min << link->poll_level;
+}
+
+static void mpc_poll_link(struct mpc_link *link, uint64_t now)
+{
+	uint64_t one = 1;
+	uint32_t v;
+
+	link->pstats.polls++;
+	link->pstats.level_us[link->poll_level] += now - link->poll_last;
+	link->poll_last = now;
+
+	v = mpc_load_acquire(link->pollv);
+	if (v != link->pollprev) {
+		link->pollprev = v;
+		link->pstats.events++;
+		link->poll_level = 0;
+		write(link->ch.fd, &one, sizeof(one));
+	} else if (link->poll_min && link->poll_level < MINIPC_POLL_LEVELS - 1
+		   && link->poll_min << link->poll_level < link->poll_max) {
+		link->poll_level++;
+	}
+	link->poll_due = now + mpc_poll_interval(link);
+}
+
+static void *mpc_poll_thread(void *unused)
+{
+	struct mpc_link *link;
+	struct timespec ts;
+	uint64_t now, next;
+
+	pthread_mutex_lock(&mpc_poll_lock);
+	while (mpc_poll_list) {
+		now = mpc_now_us();
+		next = now + 1000 * 1000;
+		for (link = mpc_poll_list; link; link = link->nextp) {
+			if (link->poll_due <= now)
+				mpc_poll_link(link, now);
+			if (link->poll_due < next)
+				next = link->poll_due;
 		}
-		if (getppid() != i)
-			exit(0);
-		usleep(__mpc_poll_usec);
+		ts.tv_sec = next / 1000000;
+		ts.tv_nsec = next % 1000000 * 1000;
+		pthread_cond_timedwait(&mpc_poll_cond, &mpc_poll_lock, &ts);
 	}
+	mpc_poll_running = 0;
+	pthread_mutex_unlock(&mpc_poll_lock);
+	return NULL;
+}
+
+static int mpc_poll_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&tid, &attr, mpc_poll_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	mpc_poll_running = 1;
+	return 0;
+}
+
+/* The thread sleeps on CLOCK_MONOTONIC, like mpc_now_us() */
+static void mpc_poll_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mpc_poll_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* The lock is released in the child, and its channels polled again */
+static void mpc_poll_prepare(void)
+{
+	pthread_mutex_lock(&mpc_poll_lock);
+}
+
+static void mpc_poll_parent(void)
+{
+	pthread_mutex_unlock(&mpc_poll_lock);
+}
+
+static void mpc_poll_child(void)
+{
+	mpc_poll_cond_init();
+	mpc_poll_running = 0;
+	if (mpc_poll_list)
+		mpc_poll_start();
+	pthread_mutex_unlock(&mpc_poll_lock);
+}
+
+static void mpc_poll_init(void)
+{
+	mpc_poll_cond_init();
+	pthread_atfork(mpc_poll_prepare, mpc_poll_parent, mpc_poll_child);
+}
+
+static int mpc_poll_add(struct mpc_link *link)
+{
+	struct mpc_shmem *shm = link->memaddr;
+	int ret = 0;
+
+	pthread_once(&mpc_poll_once, mpc_poll_init);
+	if (link->flags & MPC_FLAG_SERVER)
+		link->pollv = &shm->nrequest;
+	else
+		link->pollv = &shm->nreply;
+	link->pollprev = mpc_load_acquire(link->pollv);
+	link->poll_last = mpc_now_us();
+	link->poll_due = link->poll_last + __mpc_poll_usec;
+
+	pthread_mutex_lock(&mpc_poll_lock);
+	if (!mpc_poll_running)
+		ret = mpc_poll_start();
+	if (!ret) {
+		link->nextp = mpc_poll_list;
+		mpc_poll_list = link;
+	}
+	pthread_mutex_unlock(&mpc_poll_lock);
+	return ret;
+}
+
+/* After this, the thread won't touch the link (nor its fd) any more */
+static void mpc_poll_del(struct mpc_link *link)
+{
+	struct mpc_link **lp;
+
+	pthread_mutex_lock(&mpc_poll_lock);
+	for (lp = &mpc_poll_list; *lp; lp = &(*lp)->nextp)
+		if (*lp == link) {
+			*lp = link->nextp;
+			break;
+		}
+	pthread_mutex_unlock(&mpc_poll_lock);
+	link->pollv = NULL;
+}
+
+/* Activity is expected: poll at the minimum interval from now on */
+void mpc_poll_kick(struct mpc_link *link)
+{
+	if (!link->pollv || !link->poll_level)
+		return;
+	pthread_mutex_lock(&mpc_poll_lock);
+	link->poll_level = 0;
+	link->poll_due = mpc_now_us() + mpc_poll_interval(link);
+	pthread_cond_signal(&mpc_poll_cond);
+	pthread_mutex_unlock(&mpc_poll_lock);
+}
+
+int minipc_set_poll_range(struct minipc_ch *ch, int min_usec, int max_usec)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+
+	if (!link->pollv || min_usec <= 0 || max_usec < min_usec) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&mpc_poll_lock);
+	link->poll_min = min_usec;
+	link->poll_max = max_usec;
+	link->poll_level = 0;
+	link->poll_due = mpc_now_us() + min_usec;
+	pthread_cond_signal(&mpc_poll_cond);
+	pthread_mutex_unlock(&mpc_poll_lock);
+	return 0;
+}
+
+int minipc_get_poll_stats(struct minipc_ch *ch,
+			  struct minipc_poll_stats *stats)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+
+	if (!link->pollv) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&mpc_poll_lock);
+	*stats = link->pstats;
+	pthread_mutex_unlock(&mpc_poll_lock);
+	return 0;
 }
 
 /* helper function for memory-based channels */
@@ -150,12 +790,10 @@ static struct mpc_link *__minipc_memlink_create(struct mpc_link *link)
 {
 	void *addr = NULL;
 	long offset;
-	int memsize, pid, ret;
+	int memsize, ret;
 	int pagesize = getpagesize();
-	int pfd[2];
-	char msg;
 
-	memsize = (sizeof(struct mpc_shmem) + pagesize - 1) & ~pagesize;
+	memsize = (sizeof(struct mpc_shmem) + pagesize - 1) & ~(pagesize - 1);
 
 	/* Warning: no check for trailing garbage in name */
 	if (sscanf(link->name, "shm:%li", &offset)) {
@@ -170,7 +808,11 @@ static struct mpc_link *__minipc_memlink_create(struct mpc_link *link)
 
 	/* Warning: no check for trailing garbage in name -- hex mandatory */
 	if (sscanf(link->name, "mem:%lx", &offset)) {
-		int fd = open("/dev/mem", O_RDWR | O_SYNC);
+		/* a simulated server ("make sim") has memory in a file */
+		const char *devmem = getenv("MINIPC_MEM_FILE");
+		int fd;
+
+		fd = open(devmem ? devmem : "/dev/mem", O_RDWR | O_SYNC);
 
 		if (fd < 0)
 			return NULL;
@@ -181,33 +823,47 @@ static struct mpc_link *__minipc_memlink_create(struct mpc_link *link)
 			return NULL;
 		link->flags |= MPC_FLAG_DEVMEM;
 	}
+
+	/* A UIO device maps the memory and reports interrupts: no polling */
+	if (sscanf(link->name, "uio:%li", &offset)) {
+		char devname[32];
+		uint32_t on = 1;
+		int fd;
+
+		sprintf(devname, "/dev/uio%li", offset);
+		fd = open(devname, O_RDWR | O_NONBLOCK);
+		if (fd < 0)
+			return NULL;
+		addr = mmap(0, memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, 0 /* map 0 */);
+		if (addr == (MAP_FAILED)) {
+			close(fd);
+			return NULL;
+		}
+		write(fd, &on, sizeof(on)); /* enable irq, if supported */
+		link->flags |= MPC_FLAG_UIO;
+		link->ch.fd = fd;
+	}
+	if (!addr) {
+		errno = EINVAL;
+		return NULL;
+	}
 	link->memaddr = addr;
 	link->memsize = memsize;
-	if (link->flags & MPC_FLAG_SERVER)
+	if (link->flags & MPC_FLAG_SERVER) {
 		memset(addr, 0, sizeof(struct mpc_shmem));
+		mpc_shmem_init(addr);
+	}
+	if (link->flags & MPC_FLAG_UIO)
+		return link;
 
-	/* fork a polling process */
-	if (pipe(pfd) < 0)
+	/* the poller thread signals events through an eventfd */
+	link->ch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (link->ch.fd < 0)
 		goto err_unmap;
-	switch ( (pid = fork()) ) {
-	case 0: /* child */
-		close(pfd[0]);
-		__minipc_child(addr, pfd[1], link->flags);
-		exit(1);
-	default: /* father */
-		close(pfd[1]);
-		link->ch.fd = pfd[0];
-		link->pid = pid;
-		/* Before operating, wait for the child to ping us */
-		read (pfd[0], &msg, 1); /* must be '-' ... check? */
-		/* Now turn it into non-blocking (we poll(2)) */
-		fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
+	if (mpc_poll_add(link) == 0)
 		return link;
-	case -1:
-		break; /* error... */
-	}
-	close(pfd[0]);
-	close(pfd[1]);
+	close(link->ch.fd);
  err_unmap:
 	if (link->flags & MPC_FLAG_SHMEM)
 		shmdt(link->memaddr);
@@ -231,13 +887,14 @@ struct minipc_ch *__minipc_link_create(const char *name, int flags)
 	strncpy(link->name, name, sizeof(link->name) -1);
 
 	/* special-case the memory-based channels */
-	if (!strncmp(name, "shm:", 4) || !strncmp(name, "mem:", 4)) {
+	if (!strncmp(name, "shm:", 4) || !strncmp(name, "mem:", 4)
+	    || !strncmp(name, "uio:", 4)) {
 		if (!__minipc_memlink_create(link))
 			goto out_free;
 		goto out_success;
 	}
-	/* now create the socket and prepare the service */
-	fd = socket(SOCK_STREAM, AF_UNIX, 0);
+	/* now create the socket: seqpacket keeps one packet per recv */
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
 	if(fd < 0)
 		goto out_free;
 	link->ch.fd = fd;
@@ -262,13 +919,18 @@ struct minipc_ch *__minipc_link_create(const char *name, int flags)
  out_success:
 	if (flags & MPC_FLAG_SERVER) {
 		for (i = 0; i < MINIPC_MAX_CLIENTS; i++)
-			link->fd[i] = -1;
+			link->client[i].fd = -1;
+		for (i = 0; i < MINIPC_NR_PRIO; i++)
+			link->qmax[i] = MINIPC_MAX_CLIENTS;
 		FD_ZERO(&link->fdset);
 		FD_SET(link->ch.fd, &link->fdset);
 	}
 	link->addr = sun;
+	pthread_once(&mpc_base_once, mpc_base_init);
+	pthread_mutex_lock(&mpc_base_lock);
 	link->nextl = __mpc_base;
 	__mpc_base = link;
+	pthread_mutex_unlock(&mpc_base_lock);
 	return &link->ch;
 
  out_close:
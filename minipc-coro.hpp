@@ -0,0 +1,406 @@
+/*
+ * C++20 coroutine layer for mini-ipc (header only)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ * A client "co_await"s its calls, while the thread serves other work;
+ * a server function may be a coroutine, replying when it is done.
+ * Both are driven by an executor, that reports readable fds and timers.
+ * Only socket channels are supported, as minipc_call_send() and
+ * minipc_defer() are.
+ */
+#ifndef __MINIPC_CORO_HPP__
+#define __MINIPC_CORO_HPP__
+
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <poll.h>
+
+#include "minipc.h"
+
+namespace minipc {
+
+using clock = std::chrono::steady_clock; /* CLOCK_MONOTONIC, like the lib */
+
+/*
+ * Plug your own executor: it calls back for readable fds and timers.
+ * A timer is named by a non-zero id, and canceling one that ran
+ * already must be harmless.
+ */
+class executor {
+public:
+	using timer = unsigned long;
+	virtual ~executor() = default;
+	virtual void add(int fd, std::function<void()> f) = 0;
+	virtual void remove(int fd) = 0;
+	virtual timer at(clock::time_point t, std::function<void()> f) = 0;
+	virtual void cancel(timer id) = 0;
+};
+
+/* The simplest executor, based on poll() */
+class poll_executor : public executor {
+	using timer_list = std::multimap<clock::time_point,
+		std::pair<timer, std::function<void()>>>;
+	std::map<int, std::function<void()>> fds;
+	timer_list timers;
+	std::map<timer, timer_list::iterator> ids;
+	timer last_id = 0;
+public:
+	void add(int fd, std::function<void()> f) override
+		{ fds[fd] = std::move(f); }
+	void remove(int fd) override
+		{ fds.erase(fd); }
+	timer at(clock::time_point t, std::function<void()> f) override
+	{
+		if (!++last_id)
+			++last_id;
+		ids[last_id] = timers.emplace(t, std::make_pair(last_id,
+								std::move(f)));
+		return last_id;
+	}
+	void cancel(timer id) override
+	{
+		auto i = ids.find(id);
+
+		if (i == ids.end())
+			return;
+		timers.erase(i->second);
+		ids.erase(i);
+	}
+
+	/* One round of events: false if there is nothing to wait for */
+	bool run_once(int max_ms = -1)
+	{
+		std::vector<struct pollfd> pfd;
+		int ms = max_ms;
+
+		if (fds.empty() && timers.empty())
+			return false;
+		if (!timers.empty()) {
+			auto d = std::chrono::ceil<std::chrono::milliseconds>(
+				timers.begin()->first - clock::now()).count();
+			if (d < 0)
+				d = 0;
+			if (ms < 0 || d < ms)
+				ms = d;
+		}
+		for (auto &f : fds)
+			pfd.push_back({f.first, POLLIN, 0});
+		if (poll(pfd.data(), pfd.size(), ms) < 0 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(),
+						"poll");
+		while (!timers.empty()
+		       && timers.begin()->first <= clock::now()) {
+			auto f = std::move(timers.begin()->second.second);
+			ids.erase(timers.begin()->second.first);
+			timers.erase(timers.begin());
+			f();
+		}
+		/* callbacks may add or remove fds: look them up each time */
+		for (auto &p : pfd) {
+			if (!p.revents)
+				continue;
+			auto i = fds.find(p.fd);
+			if (i == fds.end())
+				continue;
+			auto f = i->second;
+			f();
+		}
+		return true;
+	}
+	void run() { while (run_once()) ; }
+};
+
+/* A coroutine nobody awaits: it runs at once and frees itself at the end */
+struct detached {
+	struct promise_type {
+		detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* "co_await minipc::after(ex, ms)" resumes from the executor later on */
+class after {
+	executor &ex;
+	clock::time_point t;
+public:
+	after(executor &e, int ms) : ex(e),
+		t(clock::now() + std::chrono::milliseconds(ms)) {}
+	bool await_ready() const { return false; }
+	void await_suspend(std::coroutine_handle<> h)
+		{ ex.at(t, [h]() { h.resume(); }); }
+	void await_resume() const {}
+};
+
+/* The state of a call in flight, shared by the awaiter and the client */
+struct call_state {
+	const struct minipc_pd *pd;
+	int err = 0;			/* errno, or the remote error */
+	bool done = false;
+	executor::timer timer = 0;	/* the timeout, if any */
+	std::coroutine_handle<> h;
+	unsigned char val[MINIPC_MAX_REPLY];
+};
+
+class client {
+	struct state {
+		struct minipc_ch *ch;
+		executor &ex;
+		std::map<uint32_t, std::shared_ptr<call_state>> pending;
+		state(struct minipc_ch *c, executor &e) : ch(c), ex(e) {}
+	};
+	std::shared_ptr<state> st;
+
+	/* The call is over: its timeout must not keep the executor busy */
+	static void complete(state &st, std::shared_ptr<call_state> cs,
+			     int err)
+	{
+		if (cs->timer)
+			st.ex.cancel(std::exchange(cs->timer, 0));
+		cs->err = err;
+		cs->done = true;
+		if (cs->h)
+			cs->h.resume();
+	}
+
+	static void readable(std::shared_ptr<state> st)
+	{
+		uint32_t seq;
+
+		while (minipc_call_recv(st->ch, &seq) == 0) {
+			auto i = st->pending.find(seq);
+			if (i == st->pending.end())
+				continue; /* timed out already */
+			auto cs = i->second;
+			st->pending.erase(i);
+			int err = 0;
+			if (minipc_call_decode(st->ch, cs->pd, cs->val) < 0)
+				err = errno == EREMOTEIO
+					? *(int *)cs->val : errno;
+			complete(*st, cs, err);
+		}
+		if (errno == EAGAIN)
+			return;
+		/* the connection is gone: fail everything */
+		int err = errno;
+		st->ex.remove(minipc_fileno(st->ch));
+		auto pending = std::move(st->pending);
+		for (auto &p : pending)
+			complete(*st, p.second, err);
+	}
+
+public:
+	template <class R> class awaiter {
+		std::shared_ptr<call_state> cs;
+	public:
+		awaiter(std::shared_ptr<call_state> c) : cs(std::move(c)) {}
+		bool await_ready() const { return cs->done; }
+		void await_suspend(std::coroutine_handle<> h) { cs->h = h; }
+		R await_resume() const
+		{
+			if (cs->err)
+				throw std::system_error(cs->err,
+							std::generic_category(),
+							cs->pd->name);
+			if constexpr (std::is_void_v<R>) {
+				return;
+			} else if constexpr (std::is_same_v<R, std::string>) {
+				return std::string((char *)cs->val);
+			} else {
+				static_assert(std::is_trivially_copyable_v<R>);
+				R r;
+				std::memcpy(&r, cs->val, sizeof(r));
+				return r;
+			}
+		}
+	};
+
+	client(executor &ex, const char *name, int flags = 0)
+	{
+		struct minipc_ch *ch = minipc_client_create(name, flags);
+
+		if (!ch)
+			throw std::system_error(errno, std::generic_category(),
+						name);
+		st = std::make_shared<state>(ch, ex);
+		std::weak_ptr<state> w = st;
+		ex.add(minipc_fileno(ch), [w]() {
+			if (auto s = w.lock())
+				readable(s);
+		});
+	}
+	~client()
+	{
+		/* calls still in flight are abandoned, with their timers */
+		for (auto &p : st->pending)
+			if (p.second->timer)
+				st->ex.cancel(p.second->timer);
+		st->ex.remove(minipc_fileno(st->ch));
+		minipc_close(st->ch);
+	}
+	client(const client &) = delete;
+	client &operator=(const client &) = delete;
+
+	struct minipc_ch *channel() { return st->ch; }
+
+	/*
+	 * Send the request now, and return what to co_await for the reply.
+	 * Arguments are passed as to minipc_call(), so mind their types.
+	 */
+	template <class R, class... A>
+	awaiter<R> call(const struct minipc_pd *pd, int timeout_ms, A... args)
+	{
+		auto cs = std::make_shared<call_state>();
+		uint32_t seq;
+
+		cs->pd = pd;
+		if (minipc_call_send(st->ch, timeout_ms, pd, &seq,
+				     args...) < 0) {
+			cs->err = errno;
+			cs->done = true;
+			return awaiter<R>(cs);
+		}
+		st->pending[seq] = cs;
+		if (timeout_ms >= 0) {
+			std::weak_ptr<state> w = st;
+			cs->timer = st->ex.at(clock::now()
+				  + std::chrono::milliseconds(timeout_ms),
+				  [w, seq]() {
+				auto s = w.lock();
+				if (!s)
+					return;
+				auto i = s->pending.find(seq);
+				if (i == s->pending.end())
+					return;
+				auto cs = i->second;
+				s->pending.erase(i);
+				cs->timer = 0; /* it's this one */
+				complete(*s, cs, ETIMEDOUT);
+			});
+		}
+		return awaiter<R>(cs);
+	}
+};
+
+/* The reply of a server function: if never sent, it is ECANCELED */
+class reply {
+	struct minipc_deferred *d;
+public:
+	explicit reply(struct minipc_deferred *def) : d(def) {}
+	reply(reply &&o) : d(std::exchange(o.d, nullptr)) {}
+	reply(const reply &) = delete;
+	~reply() { if (d) minipc_reply(d, ECANCELED, nullptr); }
+
+	template <class T> int send(const T &v)
+		{ return minipc_reply(std::exchange(d, nullptr), 0, &v); }
+	int send(const char *s)
+		{ return minipc_reply(std::exchange(d, nullptr), 0, s); }
+	int send(const std::string &s) { return send(s.c_str()); }
+	int fail(int err)
+		{ return minipc_reply(std::exchange(d, nullptr), err, nullptr); }
+};
+
+/*
+ * A server whose functions get a reply object. They may be coroutines
+ * (returning minipc::detached) but the args only live until the
+ * first suspension: copy what you need before any co_await.
+ * Each server has its own handlers, even for a pd exported by several:
+ * the trampoline finds them in the server whose fd is being handled.
+ */
+class server {
+public:
+	using handler = std::function<void(reply, uint32_t *args)>;
+private:
+	struct minipc_ch *ch;
+	executor &ex;
+	std::map<const struct minipc_pd *, handler> handlers;
+
+	/* the server running a request in this thread, for the trampoline */
+	static server *&current()
+	{
+		static thread_local server *s;
+		return s;
+	}
+	void handle_fd(int fd)
+	{
+		server *prev = std::exchange(current(), this);
+
+		minipc_server_handle_fd(ch, fd);
+		current() = prev;
+	}
+	static int trampoline(const struct minipc_pd *pd, uint32_t *args,
+			      void *ret)
+	{
+		server *s = current();
+		struct minipc_deferred *d;
+
+		if (!s || !s->handlers.count(pd)) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+		d = minipc_defer();
+		if (!d)
+			return -1;
+		s->handlers[pd](reply(d), args);
+		return 0;
+	}
+	/* follow the fds of the server, as clients come and go */
+	static void fd_hook(struct minipc_ch *ch, int fd, int add, void *arg)
+	{
+		server *s = static_cast<server *>(arg);
+
+		if (!add) {
+			s->ex.remove(fd);
+			return;
+		}
+		s->ex.add(fd, [s, fd]() {
+			s->handle_fd(fd);
+		});
+	}
+
+public:
+	server(executor &e, const char *name, int flags = 0) : ex(e)
+	{
+		ch = minipc_server_create(name, flags);
+		if (!ch)
+			throw std::system_error(errno, std::generic_category(),
+						name);
+		minipc_server_set_fd_hook(ch, fd_hook, this);
+	}
+	~server()
+	{
+		minipc_close(ch); /* the hook removes all fds */
+	}
+	server(const server &) = delete;
+	server &operator=(const server &) = delete;
+
+	struct minipc_ch *channel() { return ch; }
+
+	/* The pd is changed: its function becomes our trampoline */
+	int export_function(struct minipc_pd *pd, handler h)
+	{
+		pd->f = trampoline;
+		handlers[pd] = std::move(h);
+		return minipc_export(ch, pd);
+	}
+};
+
+} /* namespace minipc */
+
+#endif /* __MINIPC_CORO_HPP__ */
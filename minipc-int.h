@@ -43,7 +43,76 @@
 struct mpc_flist {
 	const struct minipc_pd *pd;
 	struct mpc_flist *next;
+#if __STDC_HOSTED__
+	struct mpc_plan *plan;
+#endif
+};
+
+/*
+ * A pd is compiled once into a plan, so calls don't decode its args
+ * again. Offsets are known up to the first string or array; after
+ * it, they depend on the length of the data being passed.
+ */
+struct mpc_plan_step {
+	uint16_t atype;
+	uint16_t asize;			/* bytes, 0 for strings, or element */
+	uint16_t nwords;
+	uint16_t off;			/* in words, if before a string */
+};
+
+struct mpc_plan {
+	const struct minipc_pd *pd;
+	struct mpc_plan *next;
+	int nsteps;
+	int nfixed;			/* steps before the first string/array */
+	int nwords;			/* words of those, and of the table */
+	int flags;
+	void *cache;			/* client: last value, if delta */
+	uint32_t gen;			/* of the cache, 0 if none */
+	struct mpc_state_block *state;	/* client: published, if mapped */
+	struct mpc_plan_step step[];
+};
+#define MPC_PLAN_SCALAR		0x0001	/* only int, int64 and double */
+#define MPC_PLAN_FD		0x0002	/* some fd is passed */
+#define MPC_PLAN_ARGTAB		0x0004	/* requests carry an offset table */
+#define MPC_PLAN_HASH		16	/* client: buckets by pd address */
+
+#if __STDC_HOSTED__
+/* Each client of a socket server has its own state */
+struct mpc_client {
+	int fd;
+	struct mpc_arena *arena;	/* if the client negotiated it */
+	struct mpc_req_packet *req;	/* receive buffer */
+	struct mpc_req_packet *p_in;	/* pending request, or NULL */
+	int prio;			/* class of the pending request */
+	uint32_t stamp;			/* arrival order of request */
+	uint64_t queued;		/* usecs, when it was received */
+	uint32_t conn;			/* connection number */
+	int fds[MINIPC_MAX_FDS], nfds;	/* passed with the request */
+	struct minipc_wait_stats wait;
+	struct mpc_delta *delta;	/* last values sent */
+};
+
+/* Server: the last value of a delta procedure, as the client has it */
+struct mpc_delta {
+	struct mpc_delta *next;
+	const struct minipc_pd *pd;
+	int size;
+	uint32_t gen;
+	uint8_t val[];
+};
+
+/* Client side of a reply stream: only one per channel */
+struct mpc_cstream {
+	const struct minipc_pd *pd;
+	uint32_t seq;
+	int window;
+	int consumed;			/* chunks not yet given back as credit */
+	int state;
 };
+#define MPC_CSTREAM_OPEN	1
+#define MPC_CSTREAM_ENDED	2
+#endif
 
 /*
  * The main server or client structure. Server links have client sockets
@@ -52,16 +121,42 @@ struct mpc_flist {
 struct mpc_link {
 	struct minipc_ch ch;
 	int magic;
-	int pid;
 	int flags;
 	struct mpc_link *nextl;
 	struct mpc_flist *flist;
 	void *memaddr;
 	int memsize;
+	uint32_t seq;			/* last request sent or served */
+	minipc_doorbell_f *doorbell;
 #if __STDC_HOSTED__ /* these fields are not used in freestanding uC */
 	FILE *logf;
 	struct sockaddr_un addr;
-	int fd[MINIPC_MAX_CLIENTS];
+	struct mpc_client client[MINIPC_MAX_CLIENTS];
+	struct mpc_arena *arena;	/* client side, if negotiated */
+	struct minipc_stats stats;
+	struct mpc_rep_packet *reply;	/* client: async reply received */
+	int replysize;
+	struct mpc_cstream cstream;	/* client: reply stream being read */
+	struct mpc_stream *streams;	/* server: replies being streamed */
+	struct mpc_delta *delta;	/* server: last values, memory ring */
+	struct mpc_state *state;	/* published state, if mapped */
+	int statefd;			/* server: passed to clients */
+	struct mpc_link *nextp;		/* memory channels being polled */
+	uint32_t *pollv, pollprev;	/* the counter the poller watches */
+	int poll_min, poll_max;		/* usecs, 0 for minipc_set_poll() */
+	int poll_level;			/* interval is poll_min << level */
+	uint64_t poll_due, poll_last;	/* usecs */
+	struct minipc_poll_stats pstats;
+	int qlen[MINIPC_NR_PRIO];	/* pending requests, per class */
+	int qmax[MINIPC_NR_PRIO];
+	uint32_t stamp;
+	int rr;				/* first client to receive from */
+	uint32_t nconn;
+	minipc_fd_f *fdhook;
+	void *fdarg;
+	struct mpc_plan *plan[MPC_PLAN_HASH];	/* client: pds called */
+	FILE *capture;
+	struct minipc_deferred *coalesce;	/* deferred, others may join */
 	fd_set fdset;
 #endif
 	char name[MINIPC_MAX_NAME];
@@ -72,26 +167,195 @@ struct mpc_link {
 #define MPC_FLAG_CLIENT		0x00020000
 #define MPC_FLAG_SHMEM		0x00040000
 #define MPC_FLAG_DEVMEM		0x00080000
+#define MPC_FLAG_UIO		0x00100000
 #define MPC_USER_FLAGS(x)	((x) & 0xffff)
 
 /* The request packet being transferred */
 struct mpc_req_packet {
 	char name[MINIPC_MAX_NAME];
+	uint32_t flags;
+	uint32_t seq;			/* echoed back in the reply */
+	uint32_t deadline;		/* CLOCK_MONOTONIC ms, 0 = none */
 	uint32_t args[MINIPC_MAX_ARGUMENTS];
 };
+#define MPC_REQ_ARENA		0x0001	/* the packet is in the arena */
+#define MPC_REQ_ARENA_SETUP	0x0002	/* the fd passed is the arena */
+#define MPC_REQ_ASYNC		0x0004	/* never reply in the arena */
+#define MPC_REQ_ARGTAB		0x0008	/* args start with offsets */
+#define MPC_REQ_STREAM		0x0010	/* the reply may be a stream */
+#define MPC_REQ_CREDIT		0x0020	/* not a request: args[0] credits */
+#define MPC_REQ_CANCEL		0x0040	/* with CREDIT: stop the stream */
+#define MPC_REQ_ONEWAY		0x0080	/* the client wants no reply */
+/* bits 8..11 carry MINIPC_FLAG_PRIO() of the client channel */
+#define MPC_REQ_DELTA		0x1000	/* the client caches the value */
+#define MPC_REQ_STATE_SETUP	0x2000	/* send back the state fd */
+/* bits 16..31 of a stream request carry the initial credit */
+#define MPC_REQ_WINDOW(f)	((f) >> 16)
+/* and those of a delta request the generation the client has (0: none) */
+#define MPC_REQ_BASE(f)		((f) >> 16)
+#define MPC_DELTA_GEN(g)	((g) & 0xffff ? (g) & 0xffff : 1)
+
 /* The reply packet being transferred */
 struct mpc_rep_packet {
 	uint32_t type;
+	uint32_t flags;
+	uint32_t seq;			/* same as the request */
+	uint32_t unused;		/* keep val 8-aligned; delta gen */
 	uint8_t val[MINIPC_MAX_REPLY];
 };
+#define MPC_REP_ARENA		0x0001	/* the packet is in the arena */
+#define MPC_REP_MORE		0x0002	/* a stream chunk, more will follow */
+#define MPC_REP_END		0x0004	/* end of stream, or its error */
+#define MPC_REP_DELTA		0x0008	/* val is changes, unused the gen */
+
+/* Bytes of header that always travel through the socket */
+#define MPC_REQ_HSIZE		offsetof(struct mpc_req_packet, args)
+#define MPC_REP_HSIZE		offsetof(struct mpc_rep_packet, val)
+
+/*
+ * Shared memory hosts a ring of slots (each takes more than 2kB).
+ * Request number "n" lives in slot n % MINIPC_MEM_SLOTS; the slot is
+ * free again when its nreply matches its nrequest.
+ *
+ * Fields written by the client and by the server live in different
+ * cache lines, to avoid false sharing, and payloads are line-aligned.
+ */
+#define MPC_CACHELINE		64
+#define __mpc_aligned		__attribute__((aligned(MPC_CACHELINE)))
+
+struct mpc_shmem_slot {
+	uint32_t	nrequest __mpc_aligned;	/* client: sequence number */
+	struct mpc_req_packet	request __mpc_aligned;
+	uint32_t	nreply __mpc_aligned;	/* server: set to nrequest */
+	struct mpc_rep_packet	reply __mpc_aligned;
+};
 
-/* A structure for shared memory (takes more than 2kB) */
 struct mpc_shmem {
-	uint32_t	nrequest;	/* incremented at each request */
-	uint32_t	nreply;		/* incremented at each reply */
+	/* written by the server at creation time */
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nslots;
+	uint32_t	order;			/* MPC_SHMEM_ORDER, as written */
+	/* client line */
+	uint32_t	nrequest __mpc_aligned;	/* incremented at each request */
+	/* server line */
+	uint32_t	nreply __mpc_aligned;	/* incremented at each reply */
+	struct mpc_shmem_slot	slot[MINIPC_MEM_SLOTS];
+};
+#define MPC_SHMEM_MAGIC		0x4d504353 /* "MPCS" */
+#define MPC_SHMEM_VERSION	5
+#define MPC_SHMEM_ORDER		0x01020304
+
+/*
+ * Counters in shared memory are accessed with acquire/release semantics:
+ * a release store of a counter publishes the slot written before it.
+ * Old freestanding compilers (e.g. for lm32) may lack C11 atomics and
+ * the gcc builtins, so fall back to full barriers.
+ */
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define mpc_load_acquire(p) \
+	atomic_load_explicit((_Atomic uint32_t *)(p), memory_order_acquire)
+#define mpc_store_release(p, v) \
+	atomic_store_explicit((_Atomic uint32_t *)(p), (v), \
+			      memory_order_release)
+#define mpc_fence_acquire()	atomic_thread_fence(memory_order_acquire)
+#define mpc_fence_release()	atomic_thread_fence(memory_order_release)
+#elif defined(__ATOMIC_ACQUIRE)
+#define mpc_load_acquire(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define mpc_store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define mpc_fence_acquire()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define mpc_fence_release()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+#define mpc_load_acquire(p) ({					\
+	uint32_t __v = *(volatile uint32_t *)(p);		\
+	__sync_synchronize();					\
+	__v; })
+#define mpc_store_release(p, v) do {				\
+	__sync_synchronize();					\
+	*(volatile uint32_t *)(p) = (v);			\
+	} while (0)
+#define mpc_fence_acquire()	__sync_synchronize()
+#define mpc_fence_release()	__sync_synchronize()
+#endif
+
+/* Plain C, so old freestanding compilers have it too */
+static inline uint32_t mpc_swab32(uint32_t x)
+{
+	return (x << 24) | ((x & 0xff00) << 8) | ((x >> 8) & 0xff00)
+		| (x >> 24);
+}
+
+/* Called by servers on a freshly zeroed area */
+static inline void mpc_shmem_init(struct mpc_shmem *shm)
+{
+	shm->nslots = MINIPC_MEM_SLOTS;
+	shm->version = MPC_SHMEM_VERSION;
+	shm->order = MPC_SHMEM_ORDER;
+	mpc_store_release(&shm->magic, MPC_SHMEM_MAGIC);
+}
+
+/*
+ * The server may have the other byte order (a big-endian soft-core for
+ * a little-endian host): then the client swaps all numbers, both ways.
+ */
+static inline int mpc_shmem_swapped(struct mpc_shmem *shm)
+{
+	return shm->order == mpc_swab32(MPC_SHMEM_ORDER);
+}
+
+static inline int mpc_shmem_check(struct mpc_shmem *shm)
+{
+	uint32_t magic = mpc_load_acquire(&shm->magic);
+
+	if (mpc_shmem_swapped(shm))
+		return magic == mpc_swab32(MPC_SHMEM_MAGIC)
+			&& shm->version == mpc_swab32(MPC_SHMEM_VERSION)
+			&& shm->nslots == mpc_swab32(MINIPC_MEM_SLOTS);
+	return magic == MPC_SHMEM_MAGIC
+		&& shm->version == MPC_SHMEM_VERSION
+		&& shm->nslots == MINIPC_MEM_SLOTS;
+}
+
+static inline struct mpc_shmem_slot *mpc_shmem_slot(struct mpc_shmem *shm,
+						    uint32_t seq)
+{
+	return shm->slot + seq % MINIPC_MEM_SLOTS;
+}
+
+/*
+ * The arena shared by a socket client and its server: packets bigger
+ * than the threshold are left here and only the header is sent
+ */
+struct mpc_arena {
 	struct mpc_req_packet	request;
 	struct mpc_rep_packet	reply;
 };
+#define MPC_ARENA_THRESHOLD	256 /* bytes */
+
+/*
+ * Published state: a memfd written by the server and mapped read-only
+ * by clients. The directory only grows, and each value is under a
+ * seqlock: its count is odd while the server is writing it.
+ */
+struct mpc_state_block {
+	char name[MINIPC_MAX_NAME];
+	uint32_t type;			/* as the pd->retval */
+	uint32_t off;			/* of the value, from the region */
+	uint32_t seq;
+};
+
+struct mpc_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nblocks;		/* release-stored after the block */
+	uint32_t used;			/* bytes of val[], server only */
+	struct mpc_state_block block[MINIPC_MAX_STATE];
+	uint8_t val[MINIPC_MAX_STATE * MINIPC_MAX_REPLY] __mpc_aligned;
+};
+#define MPC_STATE_MAGIC		0x4d505354 /* "MPST" */
+#define MPC_STATE_VERSION	1
+#define MPC_STATE_RETRIES	1000	/* then the writer is dead: call */
 
 #define MPC_TIMEOUT		1000 /* msec, hardwired */
 
@@ -111,8 +375,112 @@ extern void mpc_free_flist(struct mpc_link *link, struct mpc_flist *flist);
 
 extern struct minipc_ch *__minipc_link_create(const char *name, int flags);
 
+#if __STDC_HOSTED__
+/* Socket I/O carrying file descriptors as SCM_RIGHTS ancillary data */
+extern int mpc_send_fds(int fd, const void *buf, int len, int flags,
+			const int *fds, int nfds);
+extern int mpc_recv_fds(int fd, void *buf, int len, int flags,
+			int *fds, int *nfds);
+
+/* Deadlines are wrapping milliseconds of CLOCK_MONOTONIC */
+extern uint64_t mpc_now_us(void);
+extern uint32_t mpc_now_ms(void);
+
+static inline int mpc_expired(uint32_t deadline)
+{
+	return deadline && (int32_t)(mpc_now_ms() - deadline) > 0;
+}
+
+/* Tell the external event loop, if any, about our fds */
+static inline void mpc_fd_event(struct mpc_link *link, int fd, int add)
+{
+	if (link->fdhook)
+		link->fdhook(&link->ch, fd, add, link->fdarg);
+}
+
+/* Memory channels: consume the event(s) signalled on the channel fd */
+extern void mpc_mem_ack(struct mpc_link *link);
+extern void mpc_poll_kick(struct mpc_link *link);
+
+/* Marshalling plans, freed with the flist or the client link */
+extern struct mpc_plan *mpc_plan_compile(struct mpc_link *link,
+					 const struct minipc_pd *pd);
+
+/* Delta replies: changed ranges of a value (see minipc-core.c) */
+extern int mpc_delta_encode(const void *old, const void *new, int size,
+			    void *out);
+extern int mpc_delta_apply(void *val, int size, const void *delta, int n);
+extern void mpc_delta_free(struct mpc_delta **head);
+
+/* Byte-swap arrays of n elements, for servers of the other byte order */
+extern void mpc_swab32_array(uint32_t *p, int n);
+extern void mpc_swab64_array(uint32_t *p, int n);
+
+/* Arena helpers: size is rounded to page size */
+extern int mpc_arena_size(void);
+extern struct mpc_arena *mpc_arena_map(int fd);
+extern void mpc_arena_unmap(struct mpc_arena *arena);
+
+/* Published state: the size is rounded too */
+extern int mpc_state_size(void);
+extern struct mpc_state_block *mpc_state_find(struct mpc_state *state,
+					      const char *name);
+#endif
+
 /* Used for lists and structures -- sizeof(uint32_t) is 4, is it? */
 #define MINIPC_GET_ANUM(len) (((len) + 3) >> 2)
 
+/* Strings and arrays have a size that is only known at each call */
+static inline int mpc_atype_variable(int atype)
+{
+	return atype == MINIPC_ATYPE_STRING || atype == MINIPC_ATYPE_ARRAY;
+}
+
+/*
+ * An array is a count word, then the data, 16-byte aligned in the packet
+ * (so in memory too, as our buffers are). This is the index of the data,
+ * from the index of the count word, both from the start of args[].
+ */
+static inline int mpc_array_data(int index)
+{
+	return (index + 4) & ~3;
+}
+
+/*
+ * If some argument follows a string or array, its offset depends on data.
+ * Then the request starts with one word per argument (offset in words
+ * after the table, and length in bytes << 16), so the server never
+ * walks the data. Returns the number of words in the table.
+ */
+#define MPC_ARGTAB_OFF(word)	((word) & 0xffff)
+#define MPC_ARGTAB_LEN(word)	((word) >> 16)
+
+static inline int mpc_argtab_size(const struct minipc_pd *pd)
+{
+	int i, s = -1;
+
+	for (i = 0; MINIPC_GET_ATYPE(pd->args[i]) != MINIPC_ATYPE_NONE; i++)
+		if (s < 0 && mpc_atype_variable(MINIPC_GET_ATYPE(pd->args[i])))
+			s = i;
+	return s >= 0 && s < i - 1 ? i : 0;
+}
+
+/* Published state: fixed-size values of procedures with no arguments */
+static inline int mpc_state_pd(const struct minipc_pd *pd)
+{
+	int size = MINIPC_GET_ASIZE(pd->retval);
+
+	switch (MINIPC_GET_ATYPE(pd->retval)) {
+	case MINIPC_ATYPE_INT:
+	case MINIPC_ATYPE_INT64:
+	case MINIPC_ATYPE_DOUBLE:
+	case MINIPC_ATYPE_STRUCT:
+		break;
+	default:
+		return 0;
+	}
+	return MINIPC_GET_ATYPE(pd->args[0]) == MINIPC_ATYPE_NONE
+		&& size > 0 && size <= MINIPC_MAX_REPLY;
+}
 
 #endif /* __MINIPC_INT_H__ */
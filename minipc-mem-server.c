@@ -7,27 +7,118 @@
  * This replicates some code of minipc-core and minipc-server.
  * It implements the functions needed to make a freestanding server
  * (for example, an lm32 running on an FPGA -- the case I actually need).
+ *
+ * With MINIPC_MEM_SIM ("make sim") it is built hosted instead, to test
+ * and benchmark the mem: path without the hardware.
  */
 
 #include "minipc-int.h"
 #include <string.h>
 #include <sys/errno.h>
 
-/* HACK: use a static link, one only */
-static struct mpc_link __static_link;
+#ifdef MINIPC_MEM_SIM
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * The simulated memory is a file, that clients map in place of /dev/mem
+ * (they are told by MINIPC_MEM_FILE). Each access to the ring may cost
+ * some latency, and the service loop may only run every period_us.
+ */
+static char *mpc_sim_base;
+static unsigned long mpc_sim_size;
+static int mpc_sim_latency_ns, mpc_sim_period_us;
+
+int minipc_mem_sim(const char *fname, unsigned long size, int latency_ns,
+		   int period_us)
+{
+	void *addr;
+	int fd;
+
+	fd = open(fname, O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return -1;
+	mpc_sim_base = addr;
+	mpc_sim_size = size;
+	mpc_sim_latency_ns = latency_ns;
+	mpc_sim_period_us = period_us;
+	return 0;
+}
+
+/* Busy-wait, as a CPU stalled on the bus does */
+static void mpc_sim_delay(void)
+{
+	struct timespec ts;
+	uint64_t end;
+
+	if (!mpc_sim_latency_ns)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	end = ts.tv_sec * 1000000000ULL + ts.tv_nsec + mpc_sim_latency_ns;
+	do
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	while (ts.tv_sec * 1000000000ULL + ts.tv_nsec < end);
+}
+
+/* The real CPU does something else, before looking at the ring again */
+static void mpc_sim_period(void)
+{
+	if (mpc_sim_period_us)
+		usleep(mpc_sim_period_us);
+}
+
+static void *mpc_sim_addr(unsigned long addr, int size)
+{
+	if (!mpc_sim_base || addr + size > mpc_sim_size)
+		return NULL;
+	return mpc_sim_base + addr;
+}
+#else
+#define mpc_sim_delay()			do {} while (0)
+#define mpc_sim_period()		do {} while (0)
+#define mpc_sim_addr(addr, size)	((void *)(addr))
+#endif
+
+/* HACK: use static links, and a static array of flist shared by them */
+static struct mpc_link __static_link[MINIPC_MAX_LINKS];
+static struct mpc_flist __static_flist[MINIPC_EXPORT_POOL];
+static const int __static_nexport[MINIPC_MAX_LINKS] = MINIPC_EXPORT_SIZES;
+
+/* Each link owns a part of the array, as long as its entry in the table */
+static int mpc_flist_len(int i)
+{
+	return __static_nexport[i] ? __static_nexport[i] : MINIPC_MAX_EXPORT;
+}
+
+static struct mpc_flist *mpc_flist_table(struct mpc_link *link, int *n)
+{
+	int i, off = 0, nlink = link - __static_link;
+
+	for (i = 0; i < nlink; i++)
+		off += mpc_flist_len(i);
+	*n = mpc_flist_len(nlink);
+	if (off + *n > MINIPC_EXPORT_POOL)
+		return NULL;
+	return __static_flist + off;
+}
 
 /* The create function just picks an hex address from the name "mem:AABBCC" */
 struct minipc_ch *minipc_server_create(const char *name, int flags)
 {
-	struct mpc_link *link = &__static_link;
-	int i, c, addr = 0;
+	struct mpc_link *link = NULL;
+	int i, c, n, addr = 0;
 	int memsize = sizeof(struct mpc_shmem);
 
-	if (link->magic) {
-		errno = EBUSY;
-		return NULL;
-	}
-
 	/* Most code from __minipc_link_create and __minipc_memlink_create */
 	flags |= MPC_FLAG_SERVER;
 
@@ -36,6 +127,28 @@ struct minipc_ch *minipc_server_create(const char *name, int flags)
 		return NULL;
 	}
 
+	/* Look for a free link, refusing a second server on the same name */
+	for (i = 0; i < MINIPC_MAX_LINKS; i++) {
+		if (!__static_link[i].magic) {
+			if (!link)
+				link = __static_link + i;
+			continue;
+		}
+		if (!strcmp(__static_link[i].name, name)) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	if (!link) {
+		errno = EBUSY;
+		return NULL;
+	}
+	/* MINIPC_EXPORT_SIZES may ask for more than MINIPC_EXPORT_POOL */
+	if (!mpc_flist_table(link, &n)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	/* Ok, valid name. Hopefully */
 	link->magic = MPC_MAGIC;
 	link->flags = flags;
@@ -50,50 +163,62 @@ struct minipc_ch *minipc_server_create(const char *name, int flags)
 	}
 	link->flags |= MPC_FLAG_SHMEM; /* needed? */
 
-	link->memaddr = (void *)addr;
+	link->memaddr = mpc_sim_addr(addr, memsize);
+	if (!link->memaddr) {
+		link->magic = 0;
+		errno = EINVAL;
+		return NULL;
+	}
 	link->memsize = memsize;
-	link->pid = 0; /* hack: nrequest */
-	if (link->flags & MPC_FLAG_SERVER)
+	link->seq = 0;
+	link->doorbell = NULL;
+	link->flist = NULL;
+	if (link->flags & MPC_FLAG_SERVER) {
 		memset(link->memaddr, 0, memsize);
+		mpc_shmem_init(link->memaddr);
+	}
 
 	return &link->ch;
 }
 
-/* Close only marks the link as available */
+/* Close only marks the link as available, with all of its flist */
 int minipc_close(struct minipc_ch *ch)
 {
 	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_flist *p;
+	int n;
+
 	CHECK_LINK(link);
+	p = mpc_flist_table(link, &n);
+	memset(p, 0, n * sizeof(*p));
 	link->magic = 0; /* available */
 	return 0;
 }
 
-/* HACK: use a static array of flist, to avoid malloc and free */
-static struct mpc_flist __static_flist[MINIPC_MAX_EXPORT];
-
-static void *calloc(size_t unused, size_t unused2)
+/* Replacement for calloc and free, to avoid malloc */
+static struct mpc_flist *mpc_flist_alloc(struct mpc_link *link)
 {
-	int i;
+	int i, n;
 	struct mpc_flist *p;
 
-	for (p = __static_flist, i = 0; i < MINIPC_MAX_EXPORT; p++, i++)
+	p = mpc_flist_table(link, &n);
+	for (i = 0; i < n; p++, i++)
 		if (!p->pd)
 			break;
-	if (i == MINIPC_MAX_EXPORT) {
+	if (i == n) {
 		errno = ENOMEM;
 		return NULL;
 	}
 	return p;
 }
 
-static void free(void *ptr)
+static void mpc_flist_release(struct mpc_flist *p)
 {
-	struct mpc_flist *p = ptr;
 	p->pd = NULL;
 }
 
 
-/* From: minipc-core.c, but relying on fake free above */
+/* From: minipc-core.c, but relying on the fake free above */
 void mpc_free_flist(struct mpc_link *link, struct mpc_flist *flist)
 {
 	struct mpc_flist **nextp;
@@ -106,11 +231,11 @@ void mpc_free_flist(struct mpc_link *link, struct mpc_flist *flist)
 		return;
 	}
 	*nextp = flist->next;
-	free(flist);
+	mpc_flist_release(flist);
 }
 
 
-/* From: minipc-server.c -- but no log and relies on fake calloc above */
+/* From: minipc-server.c -- but no log and uses the per-link flist array */
 int minipc_export(struct minipc_ch *ch, const struct minipc_pd *pd)
 {
 	struct mpc_link *link = mpc_get_link(ch);
@@ -118,7 +243,7 @@ int minipc_export(struct minipc_ch *ch, const struct minipc_pd *pd)
 
 	CHECK_LINK(link);
 
-	flist = calloc(1, sizeof(*flist));
+	flist = mpc_flist_alloc(link);
 	if (!flist)
 		return -1;
 	flist->pd = pd;
@@ -161,27 +286,76 @@ uint32_t *minipc_get_next_arg(uint32_t arg[], uint32_t atype)
 	return arg + asize;
 }
 
-/* From: minipc-server.c (mostly: mpc_handle_client) */
-int minipc_server_action(struct minipc_ch *ch, int timeoutms)
+/* From: minipc-server.c */
+void *minipc_get_arg(const struct minipc_pd *pd, uint32_t *args, int n,
+		     int *len)
 {
-	struct mpc_link *link = mpc_get_link(ch);
+	int i, atype, alen, off = 0, ntab = mpc_argtab_size(pd);
+	uint32_t count;
 
+	for (i = 0; i < n; i++)
+		if (MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_NONE)
+			break;
+	atype = n < 0 ? MINIPC_ATYPE_NONE : MINIPC_GET_ATYPE(pd->args[i]);
+	if (atype == MINIPC_ATYPE_NONE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (ntab) {
+		uint32_t word = args[n - ntab];
+
+		off = MPC_ARGTAB_OFF(word);
+		if (atype == MINIPC_ATYPE_ARRAY)
+			off = mpc_array_data(ntab + off) - ntab;
+		if (ntab + off + MINIPC_GET_ANUM(MPC_ARGTAB_LEN(word))
+		    > MINIPC_MAX_ARGUMENTS) {
+			errno = EPROTO;
+			return NULL;
+		}
+		if (len)
+			*len = MPC_ARGTAB_LEN(word);
+		return args + off;
+	}
+	/* no table: strings, if any, are the last argument */
+	for (i = 0; i < n; i++)
+		if (MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_INT
+		    || MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_FD)
+			off++;
+		else
+			off += MINIPC_GET_ANUM(MINIPC_GET_ASIZE(pd->args[i]));
+	if (atype == MINIPC_ATYPE_ARRAY) {
+		/* the count is checked, as the table would be */
+		count = args[off];
+		alen = count * MINIPC_GET_ESIZE(pd->args[n]);
+		off = mpc_array_data(off);
+		if (count > MINIPC_MAX_ARGUMENTS * 4
+		    || off + MINIPC_GET_ANUM(alen) > MINIPC_MAX_ARGUMENTS) {
+			errno = EPROTO;
+			return NULL;
+		}
+		if (len)
+			*len = alen;
+	} else if (len && atype == MINIPC_ATYPE_STRING) {
+		*len = strlen((char *)(args + off));
+	} else if (len) {
+		*len = MINIPC_GET_ASIZE(pd->args[n]);
+	}
+	return args + off;
+}
+
+/* From: minipc-server.c (mostly: mpc_handle_client) */
+static void mpc_serve_slot(struct mpc_link *link, struct mpc_shmem_slot *slot)
+{
 	struct mpc_req_packet *p_in;
 	struct mpc_rep_packet *p_out;
-	struct mpc_shmem *shm = link->memaddr;
 	const struct minipc_pd *pd;
 	struct mpc_flist *flist;
 	int i;
 
-	CHECK_LINK(link);
-
-	/* keep track of the request in an otherwise unused field */
-	if (shm->nrequest == link->pid)
-		return 0;
-	link->pid = shm->nrequest;
-
-	p_in = &shm->request;
-	p_out = &shm->reply;
+	p_in = &slot->request;
+	p_out = &slot->reply;
+	p_out->flags = 0;
+	p_out->seq = p_in->seq; /* but no clock to check p_in->deadline */
 
 	/* use p_in->name to look for the function */
 	for (flist = link->flist; flist; flist = flist->next)
@@ -190,12 +364,20 @@ int minipc_server_action(struct minipc_ch *ch, int timeoutms)
 	if (!flist) {
 		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
 		*(int *)(&p_out->val) = EOPNOTSUPP;
-		goto send_reply;
+		return;
 	}
 	pd = flist->pd;
 
+	/* the offset table, if any, must be there: then skip it */
+	i = mpc_argtab_size(pd);
+	if (!(p_in->flags & MPC_REQ_ARGTAB) != !i) {
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = EPROTO;
+		return;
+	}
+
 	/* call the function and send back stuff */
-	i = pd->f(pd, p_in->args, p_out->val);
+	i = pd->f(pd, p_in->args + i, p_out->val);
 	if (i < 0) {
 		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
 		*(int *)(&p_out->val) = errno;
@@ -211,8 +393,91 @@ int minipc_server_action(struct minipc_ch *ch, int timeoutms)
 			p_out->type = pd->retval;
 		}
 	}
+}
 
- send_reply:
-	shm->nreply++; /* message already in place */
+/* Serve the next pending slot of a link, if any: return 1 if served */
+static int mpc_serve_one(struct mpc_link *link)
+{
+	struct mpc_shmem *shm = link->memaddr;
+	struct mpc_shmem_slot *slot;
+
+	if (mpc_load_acquire(&shm->nrequest) == link->seq)
+		return 0;
+	slot = mpc_shmem_slot(shm, link->seq + 1);
+	mpc_sim_delay(); /* reading the request */
+	mpc_serve_slot(link, slot);
+	mpc_sim_delay(); /* writing the reply */
+	/* message already in place: publish it */
+	link->seq++;
+	mpc_store_release(&slot->nreply, link->seq);
+	mpc_store_release(&shm->nreply, link->seq);
+	return 1;
+}
+
+/*
+ * Serve all pending slots of the ring, then ring the doorbell once.
+ * This is cheap when idle, so it can be called from an interrupt
+ * handler triggered by the host doorbell, as well as from a main loop.
+ */
+int minipc_server_action(struct minipc_ch *ch, int timeoutms)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	int n = 0;
+
+	CHECK_LINK(link);
+
+	while (mpc_serve_one(link))
+		n++;
+	if (n && link->doorbell)
+		link->doorbell(ch);
+	mpc_sim_period();
+	return 0;
+}
+
+/*
+ * Serve all links. After each request we restart from the
+ * highest-priority link (lowest MINIPC_GET_PRIO, then creation order),
+ * so a bulk channel never delays a real-time one by more than one call.
+ */
+int minipc_server_action_all(int timeoutms)
+{
+	struct mpc_link *link, *best;
+	struct mpc_shmem *shm;
+	uint32_t served = 0;
+	int i;
+
+	while (1) {
+		best = NULL;
+		for (i = 0; i < MINIPC_MAX_LINKS; i++) {
+			link = __static_link + i;
+			if (!link->magic)
+				continue;
+			shm = link->memaddr;
+			if (mpc_load_acquire(&shm->nrequest) == link->seq)
+				continue;
+			if (!best || MINIPC_GET_PRIO(link->flags)
+			    < MINIPC_GET_PRIO(best->flags))
+				best = link;
+		}
+		if (!best)
+			break;
+		mpc_serve_one(best);
+		served |= 1 << (best - __static_link);
+	}
+	for (i = 0; served; i++, served >>= 1) {
+		link = __static_link + i;
+		if ((served & 1) && link->doorbell)
+			link->doorbell(&link->ch);
+	}
+	mpc_sim_period();
+	return 0;
+}
+
+int minipc_set_doorbell(struct minipc_ch *ch, minipc_doorbell_f *f)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+	link->doorbell = f;
 	return 0;
 }
@@ -10,15 +10,19 @@
  *   the Free Software Foundation; either version 2 of the License, or
  *   (at your option) any later version.
  */
+#define _GNU_SOURCE /* memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <sys/mman.h>
 
 #include "minipc-int.h"
+#include "minipc-trace.h"
 
 /*
  * This function creates a server structure and links it to the
@@ -42,6 +46,11 @@ int minipc_export(struct minipc_ch *ch, const struct minipc_pd *pd)
 	flist = calloc(1, sizeof(*flist));
 	if (!flist)
 		return -1;
+	flist->plan = mpc_plan_compile(link, pd);
+	if (!flist->plan) {
+		free(flist);
+		return -1;
+	}
 	flist->pd = pd;
 	flist->next = link->flist;
 	link->flist = flist;
@@ -98,39 +107,690 @@ uint32_t *minipc_get_next_arg(uint32_t arg[], uint32_t atype)
 }
 
 
+/*
+ * Get a pointer to argument n, and its length in bytes if so asked.
+ * Offsets are fixed or in the table, so strings are never walked.
+ */
+void *minipc_get_arg(const struct minipc_pd *pd, uint32_t *args, int n,
+		     int *len)
+{
+	int i, atype, alen, off = 0, ntab = mpc_argtab_size(pd);
+	uint32_t count;
+
+	for (i = 0; i < n; i++)
+		if (MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_NONE)
+			break;
+	atype = n < 0 ? MINIPC_ATYPE_NONE : MINIPC_GET_ATYPE(pd->args[i]);
+	if (atype == MINIPC_ATYPE_NONE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (ntab) {
+		uint32_t word = args[n - ntab];
+
+		off = MPC_ARGTAB_OFF(word);
+		if (atype == MINIPC_ATYPE_ARRAY)
+			off = mpc_array_data(ntab + off) - ntab;
+		if (ntab + off + MINIPC_GET_ANUM(MPC_ARGTAB_LEN(word))
+		    > MINIPC_MAX_ARGUMENTS) {
+			errno = EPROTO;
+			return NULL;
+		}
+		if (len)
+			*len = MPC_ARGTAB_LEN(word);
+		return args + off;
+	}
+	/* no table: strings, if any, are the last argument */
+	for (i = 0; i < n; i++)
+		if (MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_INT
+		    || MINIPC_GET_ATYPE(pd->args[i]) == MINIPC_ATYPE_FD)
+			off++;
+		else
+			off += MINIPC_GET_ANUM(MINIPC_GET_ASIZE(pd->args[i]));
+	if (atype == MINIPC_ATYPE_ARRAY) {
+		/* the count is checked, as the table would be */
+		count = args[off];
+		alen = count * MINIPC_GET_ESIZE(pd->args[n]);
+		off = mpc_array_data(off);
+		if (count > MINIPC_MAX_ARGUMENTS * 4
+		    || off + MINIPC_GET_ANUM(alen) > MINIPC_MAX_ARGUMENTS) {
+			errno = EPROTO;
+			return NULL;
+		}
+		if (len)
+			*len = alen;
+	} else if (len && atype == MINIPC_ATYPE_STRING) {
+		*len = strlen((char *)(args + off));
+	} else if (len) {
+		*len = MINIPC_GET_ASIZE(pd->args[n]);
+	}
+	return args + off;
+}
+
+/*
+ * Replace fd indexes in the argument list with the fds we received.
+ * Returns -1 if the client referenced an fd it did not pass.
+ */
+static int mpc_fix_fds(const struct mpc_plan *plan, uint32_t *args,
+		       int *fds, int nfds)
+{
+	uint32_t *a;
+	int i;
+
+	for (i = 0; i < plan->nsteps; i++) {
+		if (plan->step[i].atype != MINIPC_ATYPE_FD)
+			continue;
+		a = minipc_get_arg(plan->pd, args, i, NULL);
+		if (!a || *a >= nfds)
+			return -1;
+		*a = fds[*a];
+	}
+	return 0;
+}
+
 /*
  * Internal functions used by server action below: handle a request
  * or the arrival of a new client
  */
-static void mpc_handle_client(struct mpc_link *link, int pos, int fd)
+/* A client passed its arena: map it, and reply with an int or error */
+static void mpc_arena_setup(struct mpc_link *link, struct mpc_client *cl,
+			    int *fds, int nfds, struct mpc_rep_packet *p_out)
+{
+	if (!cl) {
+		/* a memory slot: no socket to have passed an arena */
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = EOPNOTSUPP;
+		return;
+	}
+	if (nfds != 1 || cl->arena || !(cl->arena = mpc_arena_map(fds[0]))) {
+		if (link->logf)
+			fprintf(link->logf, "%s: can't map arena for fd %i\n",
+				__func__, cl->fd);
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = nfds != 1 ? EBADF : errno;
+		return;
+	}
+	if (link->logf)
+		fprintf(link->logf, "%s: arena %p for fd %i\n", __func__,
+			cl->arena, cl->fd);
+	p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_INT, int);
+	*(int *)(&p_out->val) = 0;
+}
+
+/*
+ * Published state: the region is created at the first publish, or when
+ * the first client asks for it. Clients can't resize it, and (if the
+ * kernel knows the seal) can only map it read-only.
+ */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0
+#endif
+
+static struct mpc_state *mpc_state_get(struct mpc_link *link)
+{
+	struct mpc_state *state;
+	int fd;
+
+	if (link->state)
+		return link->state;
+	fd = memfd_create("minipc-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		goto out;
+	if (ftruncate(fd, mpc_state_size()) < 0)
+		goto out_close;
+	state = mmap(0, mpc_state_size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	if (state == MAP_FAILED)
+		goto out_close;
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+		  | F_SEAL_FUTURE_WRITE) < 0)
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+	state->magic = MPC_STATE_MAGIC;
+	state->version = MPC_STATE_VERSION;
+	link->state = state;
+	link->statefd = fd;
+	return state;
+
+ out_close:
+	close(fd);
+ out:
+	if (link->logf)
+		fprintf(link->logf, "%s: no state: %s\n", __func__,
+			strerror(errno));
+	return NULL;
+}
+
+int minipc_state_publish(struct minipc_ch *ch, const struct minipc_pd *pd,
+			 const void *val)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_state *state;
+	struct mpc_state_block *b;
+	int n, size = MINIPC_GET_ASIZE(pd->retval);
+	uint32_t seq;
+
+	CHECK_LINK(link);
+
+	if (!(link->flags & MPC_FLAG_SERVER) || !mpc_state_pd(pd)) {
+		errno = EINVAL;
+		return -1;
+	}
+	state = mpc_state_get(link);
+	if (!state)
+		return -1;
+	b = mpc_state_find(state, pd->name);
+	if (b && b->type != pd->retval) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!b) {
+		/* a new block: clients only see it with its first value */
+		n = state->nblocks;
+		if (n == MINIPC_MAX_STATE) {
+			errno = ENOSPC;
+			return -1;
+		}
+		b = state->block + n;
+		memcpy(b->name, pd->name, MINIPC_MAX_NAME);
+		b->type = pd->retval;
+		b->off = offsetof(struct mpc_state, val) + state->used;
+		state->used += (size + MPC_CACHELINE - 1) & ~(MPC_CACHELINE - 1);
+		memcpy((uint8_t *)state + b->off, val, size);
+		mpc_store_release(&state->nblocks, n + 1);
+		mpc_trace2(publish, mpc_trace_name(pd->name), 0);
+		return 0;
+	}
+	/* readers retry if the count is odd, or changed while they copied */
+	seq = b->seq;
+	mpc_store_release(&b->seq, seq + 1);
+	mpc_fence_release();
+	memcpy((uint8_t *)state + b->off, val, size);
+	mpc_store_release(&b->seq, seq + 2);
+	mpc_trace2(publish, mpc_trace_name(pd->name), seq + 2);
+	return 0;
+}
+
+/* A client asked for the state: pass a copy of the fd */
+static int mpc_state_setup(struct mpc_link *link, struct mpc_client *cl,
+			   struct mpc_rep_packet *p_out)
+{
+	int fd = -1;
+
+	if (!cl)
+		errno = EOPNOTSUPP;
+	else if (mpc_state_get(link))
+		fd = dup(link->statefd);
+	if (fd < 0) {
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = errno;
+		return 0;
+	}
+	if (link->logf)
+		fprintf(link->logf, "%s: state for fd %i\n", __func__,
+			cl->fd);
+	p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_FD, int);
+	*(int *)(&p_out->val) = fd;
+	return 1;
+}
+
+/* Clients that don't map the state call the server: reply from it */
+static int mpc_state_reply(struct mpc_link *link, struct mpc_rep_packet *p_out,
+			   const char *name)
+{
+	struct mpc_state_block *b;
+
+	b = link->state ? mpc_state_find(link->state, name) : NULL;
+	if (!b)
+		return -1;
+	p_out->type = b->type;
+	memcpy(p_out->val, (uint8_t *)link->state + b->off,
+	       MINIPC_GET_ASIZE(b->type));
+	return 0;
+}
+
+/* Look for an exported procedure by name */
+static struct mpc_flist *mpc_find_flist(struct mpc_link *link,
+					const char *name)
+{
+	struct mpc_flist *flist;
+
+	for (flist = link->flist; flist; flist = flist->next)
+		if (!(strcmp(name, flist->pd->name)))
+			return flist;
+	return NULL;
+}
+
+static void mpc_stream_drop(struct mpc_link *link, struct mpc_client *cl);
+static void mpc_stream_credit(struct mpc_link *link, struct mpc_client *cl,
+			      struct mpc_req_packet *p_in, uint32_t n);
+
+/* Release a socket client, with its pending request if any */
+static void mpc_close_client(struct mpc_link *link, struct mpc_client *cl,
+			     int err)
+{
+	if (link->logf)
+		fprintf(link->logf, "%s: error %i in fd %i, closing\n",
+			__func__, err, cl->fd);
+	mpc_trace2(close, cl->fd, err);
+	mpc_stream_drop(link, cl);
+	if (cl->p_in)
+		link->qlen[cl->prio]--;
+	while (cl->nfds)
+		close(cl->fds[--cl->nfds]);
+	mpc_fd_event(link, cl->fd, 0);
+	close(cl->fd);
+	FD_CLR(cl->fd, &link->fdset);
+	cl->fd = -1;
+	if (cl->arena)
+		mpc_arena_unmap(cl->arena);
+	cl->arena = NULL;
+	free(cl->req);
+	cl->req = cl->p_in = NULL;
+	mpc_delta_free(&cl->delta);
+}
+
+/* Refuse service to a client: seq is 0 if there is no request yet */
+static int mpc_send_error(int fd, uint32_t seq, int err)
+{
+	struct mpc_rep_packet rep;
+
+	rep.type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+	rep.flags = 0;
+	rep.seq = seq;
+	rep.unused = 0;
+	*(int *)(&rep.val) = err;
+	return send(fd, &rep, MPC_REP_HSIZE + sizeof(int), MSG_NOSIGNAL);
+}
+
+/*
+ * Receive a request and queue it in its class: the lowest priority
+ * between the one of the client channel and the one of the procedure.
+ * If the queue of the class is full, the client gets EBUSY at once.
+ */
+static void mpc_queue_client(struct mpc_link *link, struct mpc_client *cl)
 {
-	struct mpc_req_packet *p_in, _pkt_in;
+	struct mpc_req_packet *p_in = cl->req;
+	struct mpc_flist *flist;
+	int i, prio;
+
+	i = mpc_recv_fds(cl->fd, p_in, sizeof(*p_in), 0, cl->fds, &cl->nfds);
+	if (i < 0 && errno == EINTR)
+		return;
+	if (i < (int)MPC_REQ_HSIZE) {
+		mpc_close_client(link, cl, i < 0 ? errno : 0);
+		return;
+	}
+	/* big requests are left in the arena */
+	if ((p_in->flags & MPC_REQ_ARENA) && cl->arena)
+		p_in = &cl->arena->request;
+	mpc_trace4(request, mpc_trace_name(p_in->name), cl->fd, p_in->seq, i);
+
+	/* flow control of a reply stream: not a request to queue */
+	if (p_in->flags & MPC_REQ_CREDIT) {
+		mpc_stream_credit(link, cl, p_in,
+				  i > (int)MPC_REQ_HSIZE ? p_in->args[0] : 0);
+		return;
+	}
+
+	prio = MINIPC_GET_PRIO(p_in->flags);
+	flist = mpc_find_flist(link, p_in->name);
+	if (flist && MINIPC_GET_PRIO(flist->pd->flags) > prio)
+		prio = MINIPC_GET_PRIO(flist->pd->flags);
+
+	if (link->qlen[prio] >= link->qmax[prio]) {
+		link->stats.overloaded++;
+		if (link->logf)
+			fprintf(link->logf, "%s: class %i overloaded, "
+				"refusing %s\n", __func__, prio, p_in->name);
+		while (cl->nfds)
+			close(cl->fds[--cl->nfds]);
+		if (mpc_send_error(cl->fd, p_in->seq, EBUSY) < 0)
+			mpc_close_client(link, cl, errno);
+		return;
+	}
+	cl->p_in = p_in;
+	cl->prio = prio;
+	cl->stamp = link->stamp++;
+	cl->queued = mpc_now_us();
+	link->qlen[prio]++;
+}
+
+static void mpc_account_wait(struct mpc_client *cl)
+{
+	uint64_t us = mpc_now_us() - cl->queued;
+
+	cl->wait.requests++;
+	cl->wait.total_us += us;
+	if (us > cl->wait.max_us)
+		cl->wait.max_us = us;
+}
+
+/* Bytes of a request as the client sent it, up to the last argument */
+static int mpc_req_size(struct mpc_link *link, struct mpc_req_packet *p_in)
+{
+	struct mpc_flist *flist = mpc_find_flist(link, p_in->name);
+	const struct mpc_plan *plan;
+	uint32_t *args, *p;
+	int n, len;
+
+	if (!flist || !flist->plan->nsteps)
+		return MPC_REQ_HSIZE;
+	plan = flist->plan;
+	n = plan->nsteps;
+	args = p_in->args;
+	if (plan->flags & MPC_PLAN_ARGTAB)
+		args += n;
+	p = minipc_get_arg(plan->pd, args, n - 1, &len);
+	if (!p)
+		return sizeof(*p_in);
+	if (plan->step[n - 1].atype == MINIPC_ATYPE_STRING)
+		n = p - p_in->args + MINIPC_GET_ANUM(len + 1);
+	else if (plan->step[n - 1].atype == MINIPC_ATYPE_ARRAY)
+		n = p - p_in->args + MINIPC_GET_ANUM(len);
+	else
+		n = p - p_in->args + plan->step[n - 1].nwords;
+	if (n > MINIPC_MAX_ARGUMENTS)
+		n = MINIPC_MAX_ARGUMENTS;
+	return MPC_REQ_HSIZE + n * sizeof(p_in->args[0]);
+}
+
+/* Capture mode: write the request, and what we did with it */
+static void mpc_capture(struct mpc_link *link, struct mpc_client *cl,
+			struct mpc_req_packet *p_in,
+			struct mpc_rep_packet *p_out, uint64_t start, int flags)
+{
+	struct minipc_capture_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.t_us = cl ? cl->queued : start;
+	rec.wait_us = start - rec.t_us;
+	rec.service_us = mpc_now_us() - start;
+	rec.client = cl ? cl - link->client : MINIPC_CAPTURE_MEM;
+	rec.reqsize = mpc_req_size(link, p_in);
+	rec.reptype = flags & MINIPC_CAPTURE_DEFERRED ? 0 : p_out->type;
+	rec.flags = flags;
+	if (p_in->flags & MPC_REQ_STREAM)
+		rec.flags |= MINIPC_CAPTURE_STREAM;
+	if (fwrite(&rec, sizeof(rec), 1, link->capture) != 1
+	    || fwrite(p_in, rec.reqsize, 1, link->capture) != 1) {
+		if (link->logf)
+			fprintf(link->logf, "%s: %s, capture stopped\n",
+				__func__, strerror(errno));
+		link->capture = NULL;
+	}
+}
+
+/* The request being served, so the function can defer its reply */
+static struct {
+	struct mpc_link *link;
+	struct mpc_client *cl;		/* NULL for memory channels */
+	struct mpc_req_packet *p_in;
+	const struct minipc_pd *pd;
+	int deferred;
+	int reqsize;			/* if it can be coalesced */
+} mpc_current;
+
+/* A client waiting for the reply of an identical request */
+struct mpc_waiter {
+	int client;			/* index in link->client[] */
+	uint32_t conn;			/* the index may be reused */
+	uint32_t seq, deadline;
+};
+
+/* A reply that the function will send later, with minipc_reply() */
+struct minipc_deferred {
+	struct mpc_link *link;
+	int client;			/* index in link->client[] */
+	uint32_t conn;			/* the index may be reused */
+	uint32_t seq, deadline;
+	const struct minipc_pd *pd;
+	int window;			/* credit, if the client wants a stream */
+	int oneway;			/* no reply is sent */
+	/* coalescing: the request, and those that joined it meanwhile */
+	struct minipc_deferred *next;
+	struct mpc_req_packet *req;
+	int reqsize;
+	struct mpc_waiter *waiters;
+	int nwaiters;
+};
+
+/* Set the type of a successful reply, fixing the length of strings */
+static void mpc_reply_type(const struct minipc_pd *pd,
+			   struct mpc_rep_packet *p_out)
+{
+	if (MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_STRING) {
+		int size = strlen((char *)p_out->val) + 1;
+
+		size = (size + 3) & ~3; /* align */
+		p_out->type = __MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRING, size);
+	} else {
+		p_out->type = pd->retval;
+	}
+}
+
+/* Send a reply to a socket client: a returned fd is closed after it */
+static int mpc_send_reply(struct mpc_link *link, struct mpc_client *cl,
+			  struct mpc_rep_packet *p_out, int nrfds)
+{
+	int i;
+
+	/* send the header plus the declared return length */
+	i = MPC_REP_HSIZE + MINIPC_GET_ASIZE(p_out->type);
+	if (cl->arena && p_out == &cl->arena->reply
+	    && i > MPC_ARENA_THRESHOLD) {
+		/* the reply is already in the arena: only notify */
+		p_out->flags |= MPC_REP_ARENA;
+		i = MPC_REP_HSIZE;
+	}
+	i = mpc_send_fds(cl->fd, p_out, i, MSG_NOSIGNAL,
+			 (int *)p_out->val, nrfds);
+	if (nrfds)
+		close(*(int *)p_out->val);
+	if (i < 0) {
+		mpc_close_client(link, cl, errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Coalescing: a request identical to one being served (same procedure
+ * and same argument bytes) gets the same reply, without running the
+ * function again. Requests passing fds or getting one back never are.
+ */
+static int mpc_coalesce_size(struct mpc_link *link, struct mpc_client *cl,
+			     struct mpc_flist *flist,
+			     struct mpc_req_packet *p_in)
+{
+	if (!cl || !(flist->pd->flags & MINIPC_PD_FLAG_COALESCE)
+	    || (p_in->flags & (MPC_REQ_STREAM | MPC_REQ_ONEWAY))
+	    || (flist->plan->flags & MPC_PLAN_FD)
+	    || MINIPC_GET_ATYPE(flist->pd->retval) == MINIPC_ATYPE_FD)
+		return 0;
+	return mpc_req_size(link, p_in);
+}
+
+static int mpc_same_request(struct mpc_req_packet *a,
+			    struct mpc_req_packet *b, int size)
+{
+	return !strcmp(a->name, b->name)
+		&& !memcmp(a->args, b->args, size - MPC_REQ_HSIZE);
+}
+
+/* If an identical request has a deferred reply, wait for that one */
+static int mpc_join_deferred(struct mpc_link *link, struct mpc_client *cl,
+			     struct mpc_req_packet *p_in, int size)
+{
+	struct minipc_deferred *d;
+	struct mpc_waiter *w;
+
+	for (d = link->coalesce; d; d = d->next)
+		if (d->reqsize == size && mpc_same_request(d->req, p_in, size))
+			break;
+	if (!d)
+		return 0;
+	w = realloc(d->waiters, (d->nwaiters + 1) * sizeof(*w));
+	if (!w)
+		return 0; /* so run it again */
+	d->waiters = w;
+	w += d->nwaiters++;
+	w->client = cl - link->client;
+	w->conn = cl->conn;
+	w->seq = p_in->seq;
+	w->deadline = p_in->deadline;
+	return 1;
+}
+
+/* Reply now to the queued requests identical to the one just served */
+static void mpc_coalesce_queued(struct mpc_link *link, struct mpc_client *cl,
+				struct mpc_req_packet *p_in, int size,
+				struct mpc_rep_packet *p_out, uint64_t start)
+{
+	struct mpc_rep_packet rep;
+	struct mpc_req_packet *req;
+	struct mpc_client *other;
+	int i, drop;
+
+	memcpy(&rep, p_out, MPC_REP_HSIZE + MINIPC_GET_ASIZE(p_out->type));
+	for (i = 0; i < MINIPC_MAX_CLIENTS; i++) {
+		other = link->client + i;
+		req = other->p_in;
+		if (other == cl || other->fd < 0 || !req
+		    || (req->flags & (MPC_REQ_STREAM | MPC_REQ_ONEWAY))
+		    || mpc_req_size(link, req) != size
+		    || !mpc_same_request(p_in, req, size))
+			continue;
+		/* as if it was served */
+		other->p_in = NULL;
+		link->qlen[other->prio]--;
+		mpc_account_wait(other);
+		while (other->nfds)
+			close(other->fds[--other->nfds]);
+		link->stats.coalesced++;
+		rep.seq = req->seq;
+		drop = MINIPC_CAPTURE_COALESCED;
+		if (mpc_expired(req->deadline)) {
+			link->stats.expired++;
+			drop |= MINIPC_CAPTURE_DROPPED;
+		}
+		if (link->capture)
+			mpc_capture(link, other, req, &rep, start, drop);
+		if (!(drop & MINIPC_CAPTURE_DROPPED))
+			mpc_send_reply(link, other, &rep, 0);
+	}
+}
+
+/*
+ * Delta replies: if the client has the last value we sent, only send
+ * what changed. Either way, remember the value and tell its generation.
+ */
+static void mpc_delta_reply(struct mpc_link *link, struct mpc_client *cl,
+			    const struct minipc_pd *pd,
+			    struct mpc_req_packet *p_in,
+			    struct mpc_rep_packet *p_out)
+{
+	struct mpc_delta **head = cl ? &cl->delta : &link->delta, **dp, *d;
+	int n = -1, size = MINIPC_GET_ASIZE(pd->retval);
+	uint8_t buf[MINIPC_MAX_REPLY];
+
+	for (dp = head; (d = *dp); dp = &d->next)
+		if (d->pd == pd)
+			break;
+	if (d && d->size != size) {
+		/* the name was exported again, with another pd */
+		*dp = d->next;
+		free(d);
+		d = NULL;
+	}
+	if (!d) {
+		d = malloc(sizeof(*d) + size);
+		if (!d)
+			return; /* a full reply, with no generation */
+		d->pd = pd;
+		d->size = size;
+		d->gen = 0;
+		d->next = *head;
+		*head = d;
+	}
+	if (d->gen && MPC_REQ_BASE(p_in->flags) == d->gen)
+		n = mpc_delta_encode(d->val, p_out->val, size, buf);
+	memcpy(d->val, p_out->val, size);
+	d->gen = MPC_DELTA_GEN(d->gen + 1);
+	p_out->unused = d->gen;
+	mpc_trace3(delta, mpc_trace_name(pd->name), n, size);
+	if (n < 0)
+		return;
+	memcpy(p_out->val, buf, n);
+	p_out->type = __MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRUCT, n);
+	p_out->flags |= MPC_REP_DELTA;
+}
+
+/* Serve a request: the one queued by a socket client or a memory slot */
+static void mpc_handle_client(struct mpc_link *link, struct mpc_client *cl,
+			      int fd)
+{
+	struct mpc_req_packet *p_in;
 	struct mpc_rep_packet *p_out, _pkt_out;
 	struct mpc_shmem *shm = link->memaddr;
-	const struct minipc_pd *pd;
+	struct mpc_shmem_slot *slot = NULL;
 	struct mpc_flist *flist;
-	int i;
+	const struct minipc_pd *pd = NULL;
+	uint32_t *args;
+	uint64_t start;
+	int *fds = NULL, nfds = 0, nrfds = 0, reqsize = 0, delta;
+	int i, drop = 0, oneway = 0; /* or why, for the capture */
 
 	if (shm) {
-		p_in = &shm->request;
-		p_out = &shm->reply;
-		/* read one byte, it's just a signal */
-		read(fd, &i, 1);
+		/* serve the next slot in the ring */
+		slot = mpc_shmem_slot(shm, link->seq + 1);
+		p_in = &slot->request;
+		p_out = &slot->reply;
+		mpc_trace4(request, mpc_trace_name(p_in->name), fd, p_in->seq,
+			   (int)sizeof(*p_in));
 	} else {
-		p_in = & _pkt_in;
+		p_in = cl->p_in;
 		p_out = & _pkt_out;
-		/* receive the packet and manage errors */
-		i = recv(fd, p_in, sizeof(*p_in), 0);
-		if (i < 0 && errno == EINTR)
-			return;
-		if (i <= 0)
-			goto close_client;
+		/* async clients may have several replies in flight */
+		if (cl->arena && !(p_in->flags & MPC_REQ_ASYNC))
+			p_out = &cl->arena->reply;
+		fds = cl->fds;
+		nfds = cl->nfds;
+		cl->nfds = 0;
+		cl->p_in = NULL;
+		link->qlen[cl->prio]--;
+		mpc_account_wait(cl);
+	}
+	start = link->capture ? mpc_now_us() : 0;
+	p_out->flags = 0;
+	p_out->seq = p_in->seq;
+	p_out->unused = 0;
+
+	if (p_in->flags & MPC_REQ_ARENA_SETUP) {
+		mpc_arena_setup(link, cl, fds, nfds, p_out);
+		goto send_reply;
+	}
+	if (p_in->flags & MPC_REQ_STATE_SETUP) {
+		nrfds = mpc_state_setup(link, cl, p_out);
+		goto send_reply;
+	}
+
+	/* The client gave up already: don't waste time on this one */
+	if (mpc_expired(p_in->deadline)) {
+		link->stats.expired++;
+		if (link->logf)
+			fprintf(link->logf, "%s: request %i for %s expired\n",
+				__func__, p_in->seq, p_in->name);
+		/* a memory slot must be completed anyways */
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = ETIMEDOUT;
+		drop = MINIPC_CAPTURE_DROPPED;
+		goto send_reply;
 	}
 
 	/* use p_in->name to look for the function */
-	for (flist = link->flist; flist; flist = flist->next)
-		if (!(strcmp(p_in->name, flist->pd->name)))
-			break;
+	flist = mpc_find_flist(link, p_in->name);
+	if (!flist && mpc_state_reply(link, p_out, p_in->name) == 0)
+		goto send_reply;
 	if (!flist) {
 		if (link->logf)
 			fprintf(link->logf, "%s: function %s not found\n",
@@ -144,43 +804,371 @@ static void mpc_handle_client(struct mpc_link *link, int pos, int fd)
 		fprintf(link->logf, "%s: request for %s\n",
 			__func__, pd->name);
 
+	/* both sides must agree on the layout of the arguments */
+	args = p_in->args;
+	if (flist->plan->flags & MPC_PLAN_ARGTAB)
+		args += flist->plan->nsteps;
+	if (!(p_in->flags & MPC_REQ_ARGTAB)
+	    != !(flist->plan->flags & MPC_PLAN_ARGTAB)) {
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = EPROTO;
+		goto send_reply;
+	}
+
+	/* most functions take no fd: don't even look at the args */
+	if ((flist->plan->flags & MPC_PLAN_FD)
+	    && mpc_fix_fds(flist->plan, args, fds, nfds) < 0) {
+		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&p_out->val) = EBADF;
+		goto send_reply;
+	}
+
+	/* an identical request may be served already */
+	reqsize = mpc_coalesce_size(link, cl, flist, p_in);
+	if (reqsize && mpc_join_deferred(link, cl, p_in, reqsize)) {
+		link->stats.coalesced++;
+		drop = MINIPC_CAPTURE_COALESCED;
+		goto send_reply;
+	}
+
 	/* call the function and send back stuff */
-	i = pd->f(pd, p_in->args, p_out->val);
+	mpc_current.link = link;
+	mpc_current.cl = cl;
+	mpc_current.p_in = p_in;
+	mpc_current.pd = pd;
+	mpc_current.deferred = 0;
+	mpc_current.reqsize = reqsize;
+	mpc_trace3(dispatch_start, mpc_trace_name(pd->name), fd, p_in->seq);
+	i = pd->f(pd, args, p_out->val);
+	mpc_trace4(dispatch_end, mpc_trace_name(pd->name), fd, p_in->seq,
+		   i < 0 ? errno : 0);
+	mpc_current.link = NULL;
+	if (mpc_current.deferred) {
+		/* minipc_reply() will do it */
+		drop = MINIPC_CAPTURE_DEFERRED;
+		goto send_reply;
+	}
 	if (i < 0) {
 		p_out->type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
 		*(int *)(&p_out->val) = errno;
 	} else {
-		/* Use retval, but fix the length for strings */
-		if (MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_STRING) {
-			int size = strlen((char *)p_out->val) + 1;
-
-			size = (size + 3) & ~3; /* align */
-			p_out->type =
-				__MINIPC_ARG_ENCODE(MINIPC_ATYPE_STRING, size);
-		} else {
-			p_out->type = pd->retval;
+		mpc_reply_type(pd, p_out);
+		/* A returned fd is passed to the client and closed here */
+		if (MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_FD) {
+			if (shm) {
+				close(*(int *)p_out->val);
+				p_out->type = MINIPC_ARG_ENCODE(
+					MINIPC_ATYPE_ERROR, int);
+				*(int *)(&p_out->val) = EOPNOTSUPP;
+			} else {
+				nrfds = 1;
+			}
 		}
 	}
+	/* Nobody is waiting for this reply any more */
+	if (mpc_expired(p_in->deadline)) {
+		link->stats.late++;
+		if (link->logf)
+			fprintf(link->logf, "%s: request %i for %s too late\n",
+				__func__, p_in->seq, pd->name);
+		drop = MINIPC_CAPTURE_DROPPED;
+	}
 
  send_reply:
+	/* one-way calls get no reply: their failures are only counted */
+	if (p_in->flags & MPC_REQ_ONEWAY) {
+		if (!drop && MINIPC_GET_ATYPE(p_out->type)
+		    == MINIPC_ATYPE_ERROR) {
+			link->stats.oneway_failed++;
+			if (link->logf)
+				fprintf(link->logf, "%s: one-way %s failed: "
+					"%s\n", __func__, p_in->name,
+					strerror(*(int *)p_out->val));
+		}
+		oneway = MINIPC_CAPTURE_ONEWAY;
+	}
+	/* before the reply, as the client may then reuse the request */
+	if (link->capture && !(p_in->flags & (MPC_REQ_ARENA_SETUP
+					       | MPC_REQ_STATE_SETUP)))
+		mpc_capture(link, cl, p_in, p_out, start, drop | oneway);
+	/* Received fds belong to the library: the function must dup them */
+	while (nfds)
+		close(fds[--nfds]);
+	/* after capture and coalescing, that want the whole value */
+	delta = pd && !drop && !oneway && (p_in->flags & MPC_REQ_DELTA)
+		&& MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_STRUCT
+		&& p_out->type == pd->retval;
 	if (shm) {
-		shm->nreply++; /* message already in place */
+		if (delta)
+			mpc_delta_reply(link, NULL, pd, p_in, p_out);
+		/* message already in place: publish it */
+		link->seq++;
+		mpc_store_release(&slot->nreply, link->seq);
+		mpc_store_release(&shm->nreply, link->seq);
+		mpc_trace1(shm_reply, link->seq);
+		return;
+	}
+	if (reqsize && !(drop & (MINIPC_CAPTURE_DEFERRED
+				 | MINIPC_CAPTURE_COALESCED)))
+		mpc_coalesce_queued(link, cl, p_in, reqsize, p_out, start);
+	if (drop || oneway) {
+		if (nrfds)
+			close(*(int *)p_out->val);
 		return;
 	}
-	/* send a 32-bit value plus the declared return length */
-	if (send(fd, p_out, sizeof(p_out->type)
-	     + MINIPC_GET_ASIZE(p_out->type), MSG_NOSIGNAL) < 0)
-		goto close_client;
-	return;
+	if (delta)
+		mpc_delta_reply(link, cl, pd, p_in, p_out);
+	mpc_send_reply(link, cl, p_out, nrfds);
+}
 
- close_client:
-	if (link->logf)
-		fprintf(link->logf, "%s: error %i in fd %i, closing\n",
-			__func__, i < 0 ? errno : 0, fd);
-	close(fd);
-	FD_CLR(fd, &link->fdset);
-	link->fd[pos] = -1;
-	return;
+/* Called by an exported function, to send the reply later */
+struct minipc_deferred *minipc_defer(void)
+{
+	struct mpc_link *link = mpc_current.link;
+	struct minipc_deferred *d;
+
+	if (!link || mpc_current.deferred) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!mpc_current.cl) {
+		/* the memory ring must be served in order */
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	d = malloc(sizeof(*d));
+	if (!d)
+		return NULL;
+	d->link = link;
+	d->client = mpc_current.cl - link->client;
+	d->conn = mpc_current.cl->conn;
+	d->seq = mpc_current.p_in->seq;
+	d->deadline = mpc_current.p_in->deadline;
+	d->pd = mpc_current.pd;
+	d->oneway = mpc_current.p_in->flags & MPC_REQ_ONEWAY;
+	d->window = 0;
+	if (mpc_current.p_in->flags & MPC_REQ_STREAM)
+		d->window = MPC_REQ_WINDOW(mpc_current.p_in->flags);
+	d->waiters = NULL;
+	d->nwaiters = 0;
+	d->reqsize = 0;
+	/* identical requests will join this one, until the reply */
+	d->req = mpc_current.reqsize ? malloc(mpc_current.reqsize) : NULL;
+	if (d->req) {
+		d->reqsize = mpc_current.reqsize;
+		memcpy(d->req, mpc_current.p_in, d->reqsize);
+		d->next = link->coalesce;
+		link->coalesce = d;
+	}
+	mpc_current.deferred = 1;
+	return d;
+}
+
+/* The deferred reply is ready: send it to those who joined it */
+static void mpc_reply_waiters(struct mpc_link *link, struct minipc_deferred *d,
+			      struct mpc_rep_packet *rep)
+{
+	struct minipc_deferred **dp;
+	struct mpc_client *cl;
+	struct mpc_waiter *w;
+
+	for (dp = &link->coalesce; *dp; dp = &(*dp)->next)
+		if (*dp == d) {
+			*dp = d->next;
+			break;
+		}
+	for (w = d->waiters; w < d->waiters + d->nwaiters; w++) {
+		cl = link->client + w->client;
+		if (cl->fd < 0 || cl->conn != w->conn)
+			continue;
+		if (mpc_expired(w->deadline)) {
+			link->stats.late++;
+			continue;
+		}
+		rep->seq = w->seq;
+		mpc_send_reply(link, cl, rep, 0);
+	}
+	free(d->waiters);
+	free(d->req);
+}
+
+/* Send a deferred reply: an error code, or the value (as pd->retval) */
+int minipc_reply(struct minipc_deferred *d, int err, const void *retval)
+{
+	struct mpc_link *link = d->link;
+	struct mpc_client *cl = link->client + d->client;
+	const struct minipc_pd *pd = d->pd;
+	struct mpc_rep_packet rep;
+	int nrfds = 0, ret = -1;
+
+	rep.flags = 0;
+	rep.seq = d->seq;
+	rep.unused = 0;
+	if (err) {
+		rep.type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+		*(int *)(&rep.val) = err;
+	} else if (MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_STRING) {
+		strncpy((char *)rep.val, retval, sizeof(rep.val) - 1);
+		rep.val[sizeof(rep.val) - 1] = '\0';
+		mpc_reply_type(pd, &rep);
+	} else {
+		memcpy(rep.val, retval, MINIPC_GET_ASIZE(pd->retval));
+		mpc_reply_type(pd, &rep);
+		if (MINIPC_GET_ATYPE(pd->retval) == MINIPC_ATYPE_FD)
+			nrfds = 1;
+	}
+
+	/* those who joined first, so errno is about our own client */
+	if (d->req) {
+		mpc_reply_waiters(link, d, &rep);
+		rep.seq = d->seq;
+	}
+	if (d->oneway) {
+		/* nobody waits for it */
+		if (err)
+			link->stats.oneway_failed++;
+		ret = 0;
+	} else if (cl->fd < 0 || cl->conn != d->conn) {
+		errno = ENOTCONN;
+	} else if (mpc_expired(d->deadline)) {
+		link->stats.late++;
+		errno = ETIMEDOUT;
+	} else {
+		ret = mpc_send_reply(link, cl, &rep, nrfds);
+		nrfds = 0; /* closed already */
+	}
+	if (nrfds)
+		close(*(int *)rep.val);
+	free(d);
+	return ret;
+}
+
+/*
+ * A streamed reply: values are pulled from the function's producer only
+ * while the client has credit, so nothing piles up in the server.
+ */
+struct mpc_stream {
+	struct mpc_stream *next;
+	struct minipc_deferred *d;
+	minipc_stream_f *f;
+	void *arg;
+	int credit;
+};
+
+/* Release a stream: if it was abandoned, the producer is told */
+static void mpc_stream_free(struct mpc_link *link, struct mpc_stream *st,
+			    int abandon)
+{
+	struct mpc_stream **sp;
+
+	for (sp = &link->streams; *sp; sp = &(*sp)->next)
+		if (*sp == st) {
+			*sp = st->next;
+			break;
+		}
+	if (abandon)
+		st->f(st->d, st->arg, NULL);
+	free(st->d);
+	free(st);
+}
+
+/* Send as many values as the credit allows, then the end if it's there */
+static void mpc_stream_pump(struct mpc_link *link, struct mpc_stream *st)
+{
+	struct minipc_deferred *d = st->d;
+	struct mpc_client *cl = link->client + d->client;
+	struct mpc_rep_packet rep;
+	int i;
+
+	while (st->credit > 0) {
+		rep.flags = MPC_REP_MORE;
+		rep.seq = d->seq;
+		rep.unused = 0;
+		i = st->f(d, st->arg, rep.val);
+		if (i > 0) {
+			mpc_reply_type(d->pd, &rep);
+		} else if (i < 0) {
+			rep.flags = MPC_REP_END;
+			rep.type = MINIPC_ARG_ENCODE(MINIPC_ATYPE_ERROR, int);
+			*(int *)(&rep.val) = errno;
+		} else {
+			rep.flags = MPC_REP_END;
+			rep.type = __MINIPC_ARG_ENCODE(MINIPC_ATYPE_NONE, 0);
+		}
+		if (i <= 0) {
+			/* over: the producer must not hear of it again */
+			mpc_stream_free(link, st, 0);
+			mpc_send_reply(link, cl, &rep, 0);
+			return;
+		}
+		/* on failure the client is closed, and the stream with it */
+		if (mpc_send_reply(link, cl, &rep, 0) < 0)
+			return;
+		st->credit--;
+	}
+}
+
+/* A credit packet from the client: more values, or stop */
+static void mpc_stream_credit(struct mpc_link *link, struct mpc_client *cl,
+			      struct mpc_req_packet *p_in, uint32_t n)
+{
+	struct mpc_stream *st;
+
+	for (st = link->streams; st; st = st->next)
+		if (link->client + st->d->client == cl
+		    && st->d->conn == cl->conn && st->d->seq == p_in->seq)
+			break;
+	if (!st)
+		return; /* over already */
+	if (p_in->flags & MPC_REQ_CANCEL) {
+		mpc_stream_free(link, st, 1);
+		return;
+	}
+	st->credit += n;
+	mpc_stream_pump(link, st);
+}
+
+/* The client is gone: so are its streams */
+static void mpc_stream_drop(struct mpc_link *link, struct mpc_client *cl)
+{
+	struct mpc_stream *st, *next;
+
+	for (st = link->streams; st; st = next) {
+		next = st->next;
+		if (link->client + st->d->client == cl)
+			mpc_stream_free(link, st, 1);
+	}
+}
+
+/* Reply with a stream of values: on failure, d is still to be replied */
+int minipc_stream_reply(struct minipc_deferred *d, minipc_stream_f *f,
+			void *arg)
+{
+	struct mpc_link *link = d->link;
+	struct mpc_client *cl = link->client + d->client;
+	struct mpc_stream *st;
+
+	/* only for stream clients, and not for shared replies or fds */
+	if (!d->window || d->req
+	    || MINIPC_GET_ATYPE(d->pd->retval) == MINIPC_ATYPE_FD) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (cl->fd < 0 || cl->conn != d->conn) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	st = malloc(sizeof(*st));
+	if (!st)
+		return -1;
+	st->d = d;
+	st->f = f;
+	st->arg = arg;
+	st->credit = d->window;
+	st->next = link->streams;
+	link->streams = st;
+	mpc_stream_pump(link, st);
+	return 0;
 }
 
 static void mpc_handle_connection(struct mpc_link *link, int fd)
@@ -197,24 +1185,212 @@ static void mpc_handle_connection(struct mpc_link *link, int fd)
 		return;
 	/* Lookf for a place for this */
 	for (i = 0; i < MINIPC_MAX_CLIENTS; i++)
-		if (link->fd[i] < 0)
+		if (link->client[i].fd < 0)
 			break;
 	if (i == MINIPC_MAX_CLIENTS) {
+		link->stats.refused++;
 		if (link->logf)
 			fprintf(link->logf, "%s: refused: too many clients\n",
 				__func__);
+		/* the client finds this as the reply to its first call */
+		mpc_send_error(newfd, 0, EBUSY);
+		close(newfd);
+		return;
+	}
+	link->client[i].req = malloc(sizeof(struct mpc_req_packet));
+	if (!link->client[i].req) {
 		close(newfd);
 		return;
 	}
-	link->fd[i] = newfd;
+	memset(&link->client[i].wait, 0, sizeof(link->client[i].wait));
+	link->client[i].conn = link->nconn++;
+	link->client[i].fd = newfd;
+	mpc_trace2(accept, newfd, i);
 	FD_SET(newfd, &link->fdset);
+	mpc_fd_event(link, newfd, 1);
+}
+
+/*
+ * Queue the requests of ready clients, and accept a new one if any.
+ * Requests received together are served in the order they are queued,
+ * so start from a different client each time, or low slots would win.
+ */
+static void mpc_poll_clients(struct mpc_link *link, fd_set *set)
+{
+	struct mpc_client *cl;
+	int i, n;
+
+	for (n = 0; n < MINIPC_MAX_CLIENTS; n++) {
+		i = (link->rr + n) % MINIPC_MAX_CLIENTS;
+		cl = link->client + i;
+		if (cl->fd < 0 || cl->p_in)
+			continue;
+		if (FD_ISSET(cl->fd, set))
+			mpc_queue_client(link, cl);
+	}
+	link->rr = (link->rr + 1) % MINIPC_MAX_CLIENTS;
+	if (FD_ISSET(link->ch.fd, set))
+		mpc_handle_connection(link, link->ch.fd);
+}
+
+/* The next request is the oldest one in the highest class */
+static struct mpc_client *mpc_next_client(struct mpc_link *link)
+{
+	struct mpc_client *cl, *best = NULL;
+	int i;
+
+	for (i = 0; i < MINIPC_MAX_CLIENTS; i++) {
+		cl = link->client + i;
+		if (cl->fd < 0 || !cl->p_in)
+			continue;
+		if (!best || cl->prio < best->prio
+		    || (cl->prio == best->prio
+			&& (int32_t)(cl->stamp - best->stamp) < 0))
+			best = cl;
+	}
+	return best;
+}
+
+int minipc_server_get_wait(struct minipc_ch *ch, int client,
+			   struct minipc_wait_stats *stats)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+	if (client < 0 || client >= MINIPC_MAX_CLIENTS
+	    || link->client[client].fd < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	*stats = link->client[client].wait;
+	return 0;
+}
+
+int minipc_server_set_queue(struct minipc_ch *ch, int prio, int maxlen)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+
+	CHECK_LINK(link);
+	if (prio < 0 || prio >= MINIPC_NR_PRIO || maxlen < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	link->qmax[prio] = maxlen;
+	return 0;
+}
+
+/* A shmem server has only one descriptor: serve the whole ring */
+static void mpc_serve_ring(struct mpc_link *link)
+{
+	struct mpc_shmem *shm = link->memaddr;
+
+	mpc_mem_ack(link);
+	if (link->seq == mpc_load_acquire(&shm->nrequest))
+		return;
+	while (link->seq != mpc_load_acquire(&shm->nrequest))
+		mpc_handle_client(link, NULL, link->ch.fd);
+	if (link->doorbell)
+		link->doorbell(&link->ch);
+}
+
+/*
+ * Serve queued requests by class. If so asked, while some are still
+ * queued, look for new ones that may overtake them.
+ */
+static void mpc_serve_queued(struct mpc_link *link, int repoll)
+{
+	struct mpc_client *cl;
+	struct timeval to;
+	fd_set set;
+	int i;
+
+	while ((cl = mpc_next_client(link))) {
+		mpc_handle_client(link, cl, cl->fd);
+		if (!repoll)
+			continue;
+		for (i = 0; i < MINIPC_NR_PRIO; i++)
+			if (link->qlen[i])
+				break;
+		if (i == MINIPC_NR_PRIO)
+			break;
+		to.tv_sec = to.tv_usec = 0;
+		set = link->fdset;
+		if (select(FD_SETSIZE, &set, NULL, NULL, &to) > 0)
+			mpc_poll_clients(link, &set);
+	}
+}
+
+/* Start or stop capturing requests: the file belongs to the caller */
+int minipc_server_capture(struct minipc_ch *ch, FILE *f)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct minipc_capture_hdr hdr;
+
+	CHECK_LINK(link);
+	if (f) {
+		hdr.magic = MINIPC_CAPTURE_MAGIC;
+		hdr.version = MINIPC_CAPTURE_VERSION;
+		hdr.start_us = mpc_now_us();
+		if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+			return -1;
+	}
+	link->capture = f;
+	return 0;
+}
+
+/*
+ * For external event loops: the hook is called for each fd the
+ * library uses now, and later whenever one is added or removed.
+ */
+int minipc_server_set_fd_hook(struct minipc_ch *ch, minipc_fd_f *f,
+			      void *arg)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	int i;
+
+	CHECK_LINK(link);
+	link->fdhook = f;
+	link->fdarg = arg;
+	mpc_fd_event(link, ch->fd, 1);
+	for (i = 0; i < MINIPC_MAX_CLIENTS; i++)
+		if (link->client[i].fd >= 0)
+			mpc_fd_event(link, link->client[i].fd, 1);
+	return 0;
 }
 
+/* The caller found this fd readable: serve what it brings */
+int minipc_server_handle_fd(struct minipc_ch *ch, int fd)
+{
+	struct mpc_link *link = mpc_get_link(ch);
+	struct mpc_client *cl;
+	int i;
+
+	CHECK_LINK(link);
+	if (fd == ch->fd) {
+		if (link->memaddr)
+			mpc_serve_ring(link);
+		else
+			mpc_handle_connection(link, fd);
+		return 0;
+	}
+	for (i = 0; i < MINIPC_MAX_CLIENTS; i++)
+		if (link->client[i].fd == fd)
+			break;
+	if (link->memaddr || i == MINIPC_MAX_CLIENTS) {
+		errno = EBADF;
+		return -1;
+	}
+	cl = link->client + i;
+	if (!cl->p_in)
+		mpc_queue_client(link, cl);
+	mpc_serve_queued(link, 0);
+	return 0;
+}
 
 /*
  * The server action returns an error or zero. If the user wants
- * the list of active descriptors, it must ask for the filemask
- * (at this point there is no support for poll, only select)
+ * the list of active descriptors, it must ask for the filemask,
+ * or use the fd hook above.
  */
 int minipc_server_action(struct minipc_ch *ch, int timeoutms)
 {
@@ -228,7 +1404,7 @@ int minipc_server_action(struct minipc_ch *ch, int timeoutms)
 	to.tv_sec = timeoutms/1000;
 	to.tv_usec = (timeoutms % 1000) * 1000;
 	set = link->fdset;
-	i = select(64 /* FIXME: hard constant */, &set, NULL, NULL, &to);
+	i = select(FD_SETSIZE, &set, NULL, NULL, &to);
 	if (!i)
 		return 0;
 	if (i < 0 && errno == EINTR)
@@ -240,22 +1416,12 @@ int minipc_server_action(struct minipc_ch *ch, int timeoutms)
 		return -1;
 	}
 
-	/* A shmem server has only one descriptor, for one client */
 	if (link->memaddr) {
-		mpc_handle_client(link, -1, ch->fd);
+		mpc_serve_ring(link);
 		return 0;
 	}
-
-	/* First, look for all clients */
-	for (i = 0; i < MINIPC_MAX_CLIENTS; i++) {
-		if (link->fd[i] < 0)
-			continue;
-		if (!FD_ISSET(link->fd[i], &set))
-			continue;
-		mpc_handle_client(link, i, link->fd[i]);
-	}
-	/* Finally, look for a new client */
-	if (FD_ISSET(ch->fd, &set))
-		mpc_handle_connection(link, ch->fd);
+	/* Queue all requests, then serve them by class */
+	mpc_poll_clients(link, &set);
+	mpc_serve_queued(link, 1);
 	return 0;
 }
@@ -0,0 +1,40 @@
+/*
+ * Private header for mini-ipc: static tracepoints
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ * These are USDT probes of provider "minipc", for bpftrace, perf or
+ * systemtap: each is a nop instruction until a tracer attaches to it.
+ * They are built if <sys/sdt.h> is there (the Makefile then defines
+ * MINIPC_USDT), otherwise they are not there at all.
+ *
+ * Probe arguments must be scalars or pointers: sdt.h casts each one to
+ * its own type to learn size and signedness, and arrays can't be cast.
+ * So names (char arrays in the structures) go through mpc_trace_name().
+ */
+#ifndef __MINIPC_TRACE_H__
+#define __MINIPC_TRACE_H__
+
+#define mpc_trace_name(s)		((const char *)(s))
+
+#if defined(MINIPC_USDT) && __STDC_HOSTED__
+#include <sys/sdt.h>
+
+#define mpc_trace1(name, a)		DTRACE_PROBE1(minipc, name, a)
+#define mpc_trace2(name, a, b)		DTRACE_PROBE2(minipc, name, a, b)
+#define mpc_trace3(name, a, b, c)	DTRACE_PROBE3(minipc, name, a, b, c)
+#define mpc_trace4(name, a, b, c, d)	DTRACE_PROBE4(minipc, name, a, b, c, d)
+
+#else
+
+#define mpc_trace1(name, a)		do {} while (0)
+#define mpc_trace2(name, a, b)		do {} while (0)
+#define mpc_trace3(name, a, b, c)	do {} while (0)
+#define mpc_trace4(name, a, b, c, d)	do {} while (0)
+
+#endif
+
+#endif /* __MINIPC_TRACE_H__ */
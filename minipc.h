@@ -19,13 +19,34 @@
 #include <sys/select.h>
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Hard limits */
 #define MINIPC_MAX_NAME		20 /* includes trailing 0 */
 #define MINIPC_MAX_CLIENTS	64
 #define MINIPC_MAX_ARGUMENTS	256 /* Also, max size of packet words -- 1k */
 #define MINIPC_MAX_REPLY	1024 /* bytes */
-#if !__STDC_HOSTED__
-#define MINIPC_MAX_EXPORT	12 /* freestanding: static allocation */
+#define MINIPC_MAX_FDS		8 /* file descriptors passed in one call */
+#define MINIPC_MAX_STATE	32 /* state blocks published by a server */
+/* freestanding, or simulated: static allocation, can be overridden */
+#if !__STDC_HOSTED__ || defined(MINIPC_MEM_SIM)
+#ifndef MINIPC_MAX_EXPORT
+#define MINIPC_MAX_EXPORT	12 /* exported functions, for each link */
+#endif
+#ifndef MINIPC_MAX_LINKS
+#define MINIPC_MAX_LINKS	2 /* concurrent servers, 32 at most */
+#endif
+#ifndef MINIPC_EXPORT_SIZES
+#define MINIPC_EXPORT_SIZES	{0} /* per link, by creation; 0 is MAX_EXPORT */
+#endif
+#ifndef MINIPC_EXPORT_POOL
+#define MINIPC_EXPORT_POOL	(MINIPC_MAX_LINKS * MINIPC_MAX_EXPORT)
+#endif
+#endif
+#ifndef MINIPC_MEM_SLOTS
+#define MINIPC_MEM_SLOTS	4 /* request/reply ring in memory channels */
 #endif
 
 /* The base pathname, mkdir is performed as needed */
@@ -42,15 +63,35 @@ enum minipc_at {
 	MINIPC_ATYPE_INT64,
 	MINIPC_ATYPE_DOUBLE,	/* float is promoted to double */
 	MINIPC_ATYPE_STRING,	/* size of strings is strlen() each time */
-	MINIPC_ATYPE_STRUCT
+	MINIPC_ATYPE_STRUCT,
+	MINIPC_ATYPE_FD,	/* passed out-of-band (SCM_RIGHTS), sockets only */
+	MINIPC_ATYPE_ARRAY,	/* count given at each call, see below */
 };
 /* Encoding of argument type and size in one word */
-#define __MINIPC_ARG_ENCODE(atype, asize) (((atype) << 16) | (asize))
+#define __MINIPC_ARG_ENCODE(atype, asize) \
+	(((uint32_t)(atype) << 16) | (uint32_t)(asize))
 #define MINIPC_ARG_ENCODE(atype, type) __MINIPC_ARG_ENCODE(atype, sizeof(type))
 #define MINIPC_GET_ATYPE(word) ((word) >> 16)
 #define MINIPC_GET_ASIZE(word) ((word) & 0xffff)
 #define MINIPC_ARG_END __MINIPC_ARG_ENCODE(MINIPC_ATYPE_NONE, 0) /* zero */
 
+/*
+ * Arrays of int, int64, double or struct: the size field has the type
+ * and size of one element, e.g. MINIPC_ARG_ARRAY(MINIPC_ATYPE_DOUBLE,
+ * double). The caller passes a pointer and an int count (for
+ * minipc_call_sendv, a pointer to struct minipc_array), the server gets
+ * the data with minipc_get_arg(), aligned to 16 bytes.
+ */
+#define MINIPC_ARG_ARRAY(etype, type) \
+	__MINIPC_ARG_ENCODE(MINIPC_ATYPE_ARRAY, ((etype) << 12) | sizeof(type))
+#define MINIPC_GET_ETYPE(word) (((word) >> 12) & 0xf)
+#define MINIPC_GET_ESIZE(word) ((word) & 0xfff)
+
+struct minipc_array {
+	const void *data;
+	int count;
+};
+
 /* The exported procedure looks like this */
 struct minipc_pd;
 typedef int (minipc_f)(const struct minipc_pd *, uint32_t *args, void *retval);
@@ -70,6 +111,29 @@ struct minipc_pd {
  * sockets. */
 #define MINIPC_FLAG_MSG_NOSIGNAL	1
 
+/* A socket client may ask for a shared arena where big packets are placed,
+ * so only a short header travels through the socket. If the server can't
+ * map the arena, the client silently uses the socket alone. */
+#define MINIPC_FLAG_ARENA		2
+
+/* A socket client may also map the state published by the server, to
+ * read it with no call at all. If it can't, it just calls the server. */
+#define MINIPC_FLAG_STATE		4
+
+/* Priority of a channel or procedure: 0 is the highest (real-time) */
+#define MINIPC_NR_PRIO			16
+#define MINIPC_FLAG_PRIO(p)		(((p) & 0xf) << 8)
+#define MINIPC_GET_PRIO(flags)		(((flags) >> 8) & 0xf)
+
+/* Procedure flag: identical requests in flight share one execution */
+#define MINIPC_PD_FLAG_COALESCE		0x1000
+
+/* Procedure flag: the caller doesn't wait, the server sends no reply */
+#define MINIPC_PD_FLAG_ONEWAY		0x2000
+
+/* Procedure flag: a struct reply only carries what changed since the last */
+#define MINIPC_PD_FLAG_DELTA		0x4000
+
 /* This is the channel definition */
 struct minipc_ch {
 	int fd;
@@ -84,26 +148,169 @@ int minipc_close(struct minipc_ch *ch);
 /* Generic: set the default polling interval for mem-based channels */
 int minipc_set_poll(int usec);
 
+/* Memory channels: ring a doorbell after posting requests or replies */
+typedef void (minipc_doorbell_f)(struct minipc_ch *ch);
+int minipc_set_doorbell(struct minipc_ch *ch, minipc_doorbell_f *f);
+
 /* Server: register exported functions */
 int minipc_export(struct minipc_ch *ch, const struct minipc_pd *pd);
 int minipc_unexport(struct minipc_ch *ch, const struct minipc_pd *pd);
 
 /* Server: helpers to unmarshall a string or struct from a request */
 uint32_t *minipc_get_next_arg(uint32_t arg[], uint32_t atype);
+void *minipc_get_arg(const struct minipc_pd *pd, uint32_t *args, int n,
+		     int *len);
 
 /* Handle a request if pending, otherwise -1 and EAGAIN */
 int minipc_server_action(struct minipc_ch *ch, int timeoutms);
 
+#if !__STDC_HOSTED__ || defined(MINIPC_MEM_SIM)
+/* Freestanding: handle pending requests of all servers, by priority */
+int minipc_server_action_all(int timeoutms);
+#endif
+
+#ifdef MINIPC_MEM_SIM
+/* The freestanding server, built hosted: memory is a file ("make sim") */
+#define MINIPC_MEM_SIM_FILE	"/dev/shm/minipc-mem"
+#define MINIPC_MEM_SIM_SIZE	(1024 * 1024)
+int minipc_mem_sim(const char *fname, unsigned long size, int latency_ns,
+		   int period_us);
+#endif
+
 #if __STDC_HOSTED__
 /* Generic: attach diagnostics to a log file */
 int minipc_set_logfile(struct minipc_ch *ch, FILE *logf);
 
+/* Generic: counters of unusual events, since channel creation */
+struct minipc_stats {
+	uint32_t expired;	/* server: deadline passed before running */
+	uint32_t late;		/* server: reply was too late */
+	uint32_t stale;		/* client: old replies discarded */
+	uint32_t overloaded;	/* server: requests refused, queue full */
+	uint32_t refused;	/* server: connections refused */
+	uint32_t coalesced;	/* server: requests sharing another's reply */
+	uint32_t oneway_failed;	/* server: one-way calls that failed */
+};
+int minipc_get_stats(struct minipc_ch *ch, struct minipc_stats *stats);
+
+/*
+ * Memory channels: poll every min_usec after activity, doubling the
+ * interval while idle up to max_usec. Time is accounted to each level.
+ */
+#define MINIPC_POLL_LEVELS	16	/* level i polls every min_usec << i */
+struct minipc_poll_stats {
+	uint32_t polls;		/* passes over the channel */
+	uint32_t events;	/* changes seen */
+	uint64_t level_us[MINIPC_POLL_LEVELS];
+};
+int minipc_set_poll_range(struct minipc_ch *ch, int min_usec, int max_usec);
+int minipc_get_poll_stats(struct minipc_ch *ch,
+			  struct minipc_poll_stats *stats);
+
+/* Server: requests of a class beyond maxlen are refused with EBUSY */
+int minipc_server_set_queue(struct minipc_ch *ch, int prio, int maxlen);
+
+/* Server: time spent by requests of a client in the queue */
+struct minipc_wait_stats {
+	uint32_t requests;
+	uint32_t max_us;
+	uint64_t total_us;
+};
+int minipc_server_get_wait(struct minipc_ch *ch, int client,
+			   struct minipc_wait_stats *stats);
+
+/*
+ * Server: write every request to a capture file, for later replay.
+ * The file has a header, then each record is followed by the request.
+ */
+#define MINIPC_CAPTURE_MAGIC	0x4d504343 /* "MPCC" */
+#define MINIPC_CAPTURE_VERSION	1
+struct minipc_capture_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start_us;	/* CLOCK_MONOTONIC, like the records */
+};
+struct minipc_capture_rec {
+	uint64_t t_us;		/* when the request was received */
+	uint32_t wait_us;	/* queued before running */
+	uint32_t service_us;	/* running the function */
+	uint16_t client;	/* index, MINIPC_CAPTURE_MEM for memory */
+	uint16_t reqsize;	/* bytes of request following the record */
+	uint32_t reptype;	/* as in the reply packet */
+	uint32_t flags;
+	uint32_t unused;
+};
+#define MINIPC_CAPTURE_MEM	0xffff
+#define MINIPC_CAPTURE_DROPPED	0x0001	/* expired, or too late */
+#define MINIPC_CAPTURE_DEFERRED	0x0002	/* reply not known yet */
+#define MINIPC_CAPTURE_COALESCED 0x0004	/* gets the reply of another */
+#define MINIPC_CAPTURE_ONEWAY	0x0008	/* no reply is sent */
+#define MINIPC_CAPTURE_STREAM	0x0010	/* the reply may be a stream */
+int minipc_server_capture(struct minipc_ch *ch, FILE *f);
+
+/* Server: a function may defer its reply, and send it later on */
+struct minipc_deferred;
+struct minipc_deferred *minipc_defer(void);
+int minipc_reply(struct minipc_deferred *d, int err, const void *retval);
+
+/*
+ * Server: a deferred reply may be a stream of values. The library calls
+ * f whenever the client has credit: f stores a value and returns 1,
+ * returns 0 at the end or -1 with errno. With a NULL retval, the client
+ * went away and f must only release its arg.
+ */
+typedef int (minipc_stream_f)(struct minipc_deferred *d, void *arg,
+			      void *retval);
+int minipc_stream_reply(struct minipc_deferred *d, minipc_stream_f *f,
+			void *arg);
+
+/*
+ * Server: publish the value of a procedure with no arguments, so clients
+ * read it from shared memory (or with a call, answered by the library)
+ */
+int minipc_state_publish(struct minipc_ch *ch, const struct minipc_pd *pd,
+			 const void *val);
+
 /* Return an fdset for the user to select() on the service */
 int minipc_server_get_fdset(struct minipc_ch *ch, fd_set *setptr);
 
+/* Server: for poll/epoll loops, be told of fds, and serve a ready one */
+typedef void (minipc_fd_f)(struct minipc_ch *ch, int fd, int add, void *arg);
+int minipc_server_set_fd_hook(struct minipc_ch *ch, minipc_fd_f *f,
+			      void *arg);
+int minipc_server_handle_fd(struct minipc_ch *ch, int fd);
+
 /* Client: make requests */
 int minipc_call(struct minipc_ch *ch, int millisec_timeout,
 		const struct minipc_pd *pd, void *ret, ...);
+
+/* Client: asynchronous requests, sockets only. Replies are matched by seq */
+int minipc_call_send(struct minipc_ch *ch, int millisec_timeout,
+		     const struct minipc_pd *pd, uint32_t *seq, ...);
+int minipc_call_sendv(struct minipc_ch *ch, int millisec_timeout,
+		      const struct minipc_pd *pd, uint32_t *seq,
+		      void * const *argv);
+int minipc_call_send_raw(struct minipc_ch *ch, int millisec_timeout,
+			 const void *req, int size, uint32_t *seq);
+int minipc_call_recv(struct minipc_ch *ch, uint32_t *seq);
+int minipc_call_decode(struct minipc_ch *ch, const struct minipc_pd *pd,
+		       void *ret);
+
+/* Client: read a stream of replies, one stream at a time per channel */
+#define MINIPC_STREAM_WINDOW	16	/* default credit, in values */
+int minipc_stream_open(struct minipc_ch *ch, int millisec_timeout,
+		       const struct minipc_pd *pd, int window, ...);
+int minipc_stream_next(struct minipc_ch *ch, int millisec_timeout,
+		       void *ret);
+int minipc_stream_close(struct minipc_ch *ch);
+
+/* Client: read published state, or call the server if it's not mapped */
+int minipc_state_read(struct minipc_ch *ch, int millisec_timeout,
+		      const struct minipc_pd *pd, void *ret);
 #endif /* __STDC_HOSTED__ */
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __MINIPC_H__ */